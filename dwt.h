@@ -58,12 +58,11 @@ typedef struct
 
 static __attribute__((always_inline)) inline void DWTDelayCycles(uint32_t c) {
     DWT->CYCCNT = 0; 
-    while (DWT->CYCCNT < _cyclesToDelay);
+    while (DWT->CYCCNT < c);
 }
 
 #define MicrosecondsToCycles(n) ((n) * SystemCoreClock / 1000000ul)
 #define DWTDelayMicroseconds(n) DWTDelayCycles(MicrosecondsToCycles(n))
-#define DWTDelayNanoseconds(n) DWTDelayCycles(NanosecondsToCycles(n))
 #define DWTDelayNanoseconds(n) DWTDelayCycles((unsigned long long)(n) * SystemCoreClock / 1000000000ull)
 
 #endif
@@ -10,11 +10,18 @@
 //
 // The storage method is incompatible with the one implemented by the EEPROM-emulation library, as it's optimized
 // for our single-byte usage case. 
+//
+// EEPROM8_storeValue() only stages a value in RAM; repeated stores to the same variable coalesce. The flash is
+// written by EEPROM8_commitStep(), one half-word per call, and a page erase (which stalls the CPU for tens of ms)
+// only happens on a call that allows it.
 
 uint32_t pageBase;
 uint8 storage[255];
 
 static boolean invalid = true;
+static uint8_t dirty[32]; // bitmap of variables whose value in storage[] hasn't been written yet
+static uint32_t nextFreeOffset;
+static bool needErase = false;
 
 #define EEPROM8_MEMORY_SIZE (2*EEPROM_PAGE_SIZE)
 #define GET_BYTE(address) (*(__IO uint8_t*)(address))
@@ -62,6 +69,13 @@ static bool writeHalfWord(uint32_t address, uint16_t halfWord) {
   return success && GET_HALF_WORD(address) == halfWord;
 }
 
+static inline void setDirty(uint8_t variable, bool value) {
+  if (value)
+    dirty[variable >> 3] |= 1 << (variable & 7);
+  else
+    dirty[variable >> 3] &= ~(1 << (variable & 7));
+}
+
 boolean EEPROM8_storeValue(uint8_t variable, uint8_t value) {
   if (invalid || variable >= 255)
     return false;
@@ -70,42 +84,59 @@ boolean EEPROM8_storeValue(uint8_t variable, uint8_t value) {
     return true;
     
   storage[variable] = value;
-    
-  for (uint32_t offset = 4 ; offset < EEPROM_PAGE_SIZE ; offset+=2) {
-    if (GET_HALF_WORD(pageBase+offset) == 0xFFFF) {
-      return writeHalfWord(pageBase+offset, variable | ((uint16_t)value<<8));
+  setDirty(variable, true);
+  return true;
+}
+
+// Does at most one flash operation. Returns true if it did one.
+boolean EEPROM8_commitStep(boolean allowErase) {
+  if (invalid)
+    return false;
+
+  if (needErase) {
+    if (!allowErase)
+      return false;
+    if (!erasePage(pageBase)) {
+      invalid = true;
+      return true;
     }
+    needErase = false;
+    nextFreeOffset = 4;
+    // everything nonzero has to be written again, a half-word per call
+    for (uint32_t variable = 0 ; variable < 255; variable++) 
+      setDirty(variable, 0 != storage[variable]);
+    return true;
   }
 
-  // page is full
-  if (!erasePage(pageBase))
-    return false;
-  uint32 offset = 4;
-  bool err = false;  
-  for (uint32_t variable = 0 ; variable < 255; variable++) 
-    if (0 != storage[variable]) {
-        if (!writeHalfWord(pageBase+offset, variable | ((uint16_t)storage[variable]<<8))) {
-            err = true;
-            offset += 2;
-        }
-        else {
-            offset += 2;
-        }
+  for (uint32_t i = 0 ; i < sizeof(dirty) ; i++) {
+    if (dirty[i]) {
+      uint8_t variable = i * 8 + __builtin_ctz(dirty[i]);
+      if (nextFreeOffset >= EEPROM_PAGE_SIZE) {
+        // page is full
+        needErase = true;
+        return false;
+      }
+      if (!writeHalfWord(pageBase+nextFreeOffset, variable | ((uint16_t)storage[variable]<<8))) {
+        needErase = true;
+      }
+      else {
+        setDirty(variable, false);
+      }
+      nextFreeOffset += 2;
+      return true;
     }
+  }
 
-  return !err;
+  return false;
 }
 
 
-static void EEPROM8_reset(void) {
-  if (erasePage(pageBase)) {
-    invalid = false;
-  }
-  else {
-    invalid = true;
-  }
+void EEPROM8_reset(void) {
   for(uint32_t i=0; i<255; i++)
     storage[i] = 0;
+  memset(dirty, 0, sizeof(dirty));
+  invalid = false;
+  needErase = true;
 }
 
 
@@ -119,11 +150,18 @@ void EEPROM8_init(void) {
     invalid = true;
     return;
   }
+  nextFreeOffset = EEPROM_PAGE_SIZE;
   for (uint32_t offset = 4 ; offset < EEPROM_PAGE_SIZE ; offset+=2) {
+    if (GET_HALF_WORD(pageBase+offset) == 0xFFFF) {
+      nextFreeOffset = offset;
+      break;
+    }
     uint8_t i = GET_BYTE(pageBase+offset);
     if (i < 255)
         storage[i] = GET_BYTE(pageBase+offset+1);
   }
+  memset(dirty, 0, sizeof(dirty));
+  needErase = false;
   invalid = false;
 }
-
+
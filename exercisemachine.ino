@@ -4,27 +4,86 @@
 #define MAX_USABLE_RPM      300
 #define SLOWEST_REASONABLE_RPM 6
 
+#define MAX_HEART_RATE 240
+#define MIN_HEART_RATE 20
+
 const uint32_t turnOffSliderTime = 10000l;
 const uint32_t shortestReasonableRotationTime = 1000l * 60 / BEST_REASONABLE_RPM;
 const uint32_t shortestAllowedRotationTime = 1000l * 60 / MAX_USABLE_RPM;
 const uint32_t longestReasonableRotationTime = 1000l * 60 / SLOWEST_REASONABLE_RPM;
-uint32_t lastPulse = 0;
-int32_t exerciseMachineSpeed;
-volatile uint32_t exerciseMachineTriggerTime = 0;
-volatile uint32_t lastExerciseMachinePeriod = 0;
-volatile bool exerciseMachinePulsed = 0;
+const uint32_t shortestAllowedHeartBeatTime = 1000l * 60 / MAX_HEART_RATE;
+const uint32_t longestReasonableHeartBeatTime = 1000l * 60 / MIN_HEART_RATE;
+
+PulseChannel_t wheel = { 0, 0, false, shortestAllowedRotationTime };
+#ifdef ENABLE_CRANK_SENSOR
+PulseChannel_t crank = { 0, 0, false, shortestAllowedRotationTime };
+#endif
+#ifdef ENABLE_HEART_RATE_SENSOR
+PulseChannel_t heart = { 0, 0, false, shortestAllowedHeartBeatTime };
+#endif
+#ifdef ENABLE_RESISTANCE_KNOB
+adc_reg_map* resistanceADC;
+const uint16_t knobHysteresis = 3; // ADC noise is a count or two, in the 10-bit scale
+uint16_t knobPosition = 0;
+#endif
 
 Debounce debounceRotation(rotationDetector, LOW);
 Debounce debounceDirection(directionSwitch, DIRECTION_SWITCH_FORWARD);
 
-void exerciseMachineInterrupt() {
+static inline void pulseInterrupt(PulseChannel_t* c) {
   uint32_t t = millis();
-  uint32_t delta = (uint32_t)(t-exerciseMachineTriggerTime);
-  if (delta < shortestAllowedRotationTime) // assume glitch
+  uint32_t delta = (uint32_t)(t-c->triggerTime);
+  if (delta < c->shortestAllowedPeriod) // assume glitch
     return;
-  exerciseMachineTriggerTime = t;
-  lastExerciseMachinePeriod = delta;
-  exerciseMachinePulsed = true;
+  c->triggerTime = t;
+  c->period = delta;
+  c->pulsed = true;
+}
+
+void exerciseMachineInterrupt() {
+  pulseInterrupt(&wheel);
+}
+
+#ifdef ENABLE_CRANK_SENSOR
+void crankInterrupt() {
+  pulseInterrupt(&crank);
+}
+#endif
+
+#ifdef ENABLE_HEART_RATE_SENSOR
+void heartRateInterrupt() {
+  pulseInterrupt(&heart);
+}
+#endif
+
+// Updates c->speed from the latest pulse period, letting it decay when pulses stop.
+// Returns true if there was a new pulse.
+static bool updateRotationSpeed(PulseChannel_t* c) {
+  uint32_t dt = millis() - c->lastPulse;
+
+  if (dt > longestReasonableRotationTime) {
+    c->speed = 0;
+  }
+  else if ( MAX_SPEED_VALUE * shortestReasonableRotationTime < dt * c->speed) {
+    c->speed = MAX_SPEED_VALUE * shortestReasonableRotationTime / dt;
+  }
+
+  if (! c->pulsed)
+    return false;
+
+  c->pulsed = false;
+  c->lastPulse = millis();
+  dt = c->period;
+  if (dt > longestReasonableRotationTime) {
+      c->speed = 0;
+  }
+  else {
+    if (dt < shortestReasonableRotationTime) {
+      dt = shortestReasonableRotationTime;
+    }
+    c->speed = MAX_SPEED_VALUE * shortestReasonableRotationTime / dt;
+  } 
+  return true;
 }
 
 void exerciseMachineInit() {
@@ -33,52 +92,85 @@ void exerciseMachineInit() {
   pinMode(directionSwitch, INPUT_PULLDOWN);
   attachInterrupt(rotationDetector, exerciseMachineInterrupt, ROTATION_DETECTOR_CHANGE_TO_MONITOR);
   debounceDirection.begin();
+#ifdef ENABLE_CRANK_SENSOR
+  pinMode(crankDetector, INPUT_PULLUP);
+  attachInterrupt(crankDetector, crankInterrupt, ROTATION_DETECTOR_CHANGE_TO_MONITOR);
+#endif
+#ifdef ENABLE_HEART_RATE_SENSOR
+  pinMode(heartRateDetector, INPUT);
+  attachInterrupt(heartRateDetector, heartRateInterrupt, HEART_RATE_CHANGE_TO_MONITOR);
+#endif
+#ifdef ENABLE_RESISTANCE_KNOB
+  // Do one ordinary conversion to select the channel, then leave the ADC converting continuously,
+  // so that reading the knob is just a register read
+  pinMode(resistanceKnob, INPUT_ANALOG);
+  analogRead(resistanceKnob);
+  resistanceADC = PIN_MAP[resistanceKnob].adc_device->regs;
+  resistanceADC->CR2 |= ADC_CR2_CONT;
+  resistanceADC->CR2 |= ADC_CR2_SWSTART;
+#endif
 #endif
   exerciseMachineRotationDetector = debounceRotation.getState();
-  exerciseMachineSpeed = 0;
+  wheel.speed = 0;
 }
 
 void exerciseMachineUpdate(ExerciseMachineData_t* data) {
 #ifdef ENABLE_EXERCISE_MACHINE
-  uint32_t dt = millis() - lastPulse;
-
-  if (dt > longestReasonableRotationTime) {
-    exerciseMachineSpeed = 0;
-    if (dt > turnOffSliderTime)
-      data->valid = false;
-  }
-  else if ( 800 * shortestReasonableRotationTime < dt * exerciseMachineSpeed) {
-    exerciseMachineSpeed = 800 * shortestReasonableRotationTime / dt;
-  }
-
-  if (exerciseMachinePulsed) {
-    exerciseMachinePulsed = false;
+  if (updateRotationSpeed(&wheel)) {
     exerciseMachineRotationDetector = 1;
     updateLED();
     data->valid = true;
-    lastPulse = millis();
-    dt = lastExerciseMachinePeriod;
-    if (dt > longestReasonableRotationTime) {
-        exerciseMachineSpeed = 0;
-    }
-    else {
-      if (dt < shortestReasonableRotationTime) {
-        dt = shortestReasonableRotationTime;
-      }
-      exerciseMachineSpeed = 800 * shortestReasonableRotationTime / dt;
-    } 
   }
-  else if (exerciseMachineRotationDetector && dt >= 50 && ROTATION_DETECTOR_ACTIVE_STATE != digitalRead(rotationDetector)) {
+  else {
+    uint32_t dt = millis() - wheel.lastPulse;
+    if (dt > turnOffSliderTime)
+      data->valid = false;
+    if (exerciseMachineRotationDetector && dt >= 50 && ROTATION_DETECTOR_ACTIVE_STATE != digitalRead(rotationDetector)) {
       exerciseMachineRotationDetector = 0;
       updateLED();
+    }
   }
   
-  data->speed = exerciseMachineSpeed;
+  data->speed = wheel.speed;
   data->direction = debounceDirection.getState();
+
+#ifdef ENABLE_CRANK_SENSOR
+  updateRotationSpeed(&crank);
+  data->cadence = crank.speed;
+#else
+  data->cadence = 0;
+#endif
+
+#ifdef ENABLE_HEART_RATE_SENSOR
+  if (heart.pulsed) {
+    heart.pulsed = false;
+    heart.lastPulse = millis();
+    heart.speed = heart.period <= longestReasonableHeartBeatTime ? 1000l * 60 / heart.period : 0;
+  }
+  else if (millis() - heart.lastPulse > longestReasonableHeartBeatTime) {
+    heart.speed = 0;
+  }
+  data->heartRate = heart.speed;
+#else
+  data->heartRate = 0;
+#endif
+
+#ifdef ENABLE_RESISTANCE_KNOB
+  // only follow the knob once it moves by more than the noise, except at the ends of its travel
+  uint16_t knob = (resistanceADC->DR & 0xFFF) >> 2;
+  if (knob > knobPosition + knobHysteresis || knob + knobHysteresis < knobPosition || knob == 0 || knob == 1023)
+    knobPosition = knob;
+  data->resistance = knobPosition;
+#else
+  data->resistance = 0;
+#endif
   DEBUG("Speed "+String(data->speed));
 #else
   data->speed = 0;
   data->direction = 1;
+  data->cadence = 0;
+  data->heartRate = 0;
+  data->resistance = 0;
 #endif
 }
-
+
@@ -6,6 +6,7 @@
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
 
 //#define SERIAL_DEBUG
+//#define BENCHMARK_INJECT // count inject() cycles; read with the "cycles?" feature request
 
 #include <USBComposite.h>
 
@@ -43,6 +44,17 @@ USBCompositeSerial CompositeSerial;
 #ifdef ALEXS_BUILD
 #define ENABLE_EXERCISE_MACHINE
 #endif
+// extra exercise machine sensors; leave these off unless the hardware is connected
+//#define ENABLE_CRANK_SENSOR
+//#define ENABLE_HEART_RATE_SENSOR
+//#define ENABLE_RESISTANCE_KNOB
+
+// Poll the GameCube controller from a timer interrupt rather than from loop(). The nunchuck is
+// read from loop() either way: its I2C library relies on interrupts and millis() timeouts, which
+// can't run inside another interrupt.
+#ifdef ENABLE_GAMECUBE
+#define POLL_IN_INTERRUPT
+#endif
 
 #define EEPROM_VARIABLE_INJECTION_MODE 0
 
@@ -50,6 +62,7 @@ USBCompositeSerial CompositeSerial;
 #define ROTATION_DETECTOR_CHANGE_TO_MONITOR FALLING 
 
 #define ROTATION_DETECTOR_ACTIVE_STATE ((ROTATION_DETECTOR_CHANGE_TO_MONITOR == FALLING) ? LOW : HIGH)
+#define HEART_RATE_CHANGE_TO_MONITOR RISING
 
 /*
 typedef struct {
@@ -64,12 +77,31 @@ typedef struct {
 } GameControllerData_t;
 */
 
+typedef struct {
+  GameControllerData_t data;
+  uint32_t time; // micros() when acquired
+  bool valid;
+} ControllerSample_t;
+
 typedef struct {
   int32_t speed;
   uint8_t direction;
   uint8_t valid;
+  int32_t cadence; // crank sensor, same scale as speed
+  uint16_t heartRate; // beats per minute, 0 if no recent beats
+  uint16_t resistance; // knob position, 0-1023
 } ExerciseMachineData_t;
 
+// Pulse timing for one sensor, filled in by its interrupt
+typedef struct {
+  volatile uint32_t triggerTime;
+  volatile uint32_t period;
+  volatile bool pulsed;
+  uint32_t shortestAllowedPeriod; // anything faster is assumed to be a glitch
+  uint32_t lastPulse;
+  int32_t speed;
+} PulseChannel_t;
+
 typedef struct {
   void (*begin)();
   void (*end)();
@@ -81,6 +113,7 @@ void exerciseMachineInit(void);
 extern HIDJoystick Joystick2;
 
 void updateLED(void);
+void pollControllers(void);
 void beginUSBHID();
 void endUSBHID();
 void beginDual();
@@ -95,8 +128,14 @@ void endSwitch();
 uint8_t loadInjectionMode(void);
 void saveInjectionMode(uint8_t mode);
 
+void EEPROM8_init(void);
+uint8 EEPROM8_getValue(uint8_t variable);
+boolean EEPROM8_storeValue(uint8_t variable, uint8_t value);
+boolean EEPROM8_commitStep(boolean allowErase);
+void EEPROM8_reset(void);
+
 uint8_t validDevices[2] = {CONTROLLER_NONE,CONTROLLER_NONE};
-uint8_t validUSB = 0;
+volatile uint8_t validUSB = 0;
 #ifdef ENABLE_AUTO_CALIBRATE
 bool needToCalibrate = true;
 #endif
@@ -105,6 +144,8 @@ uint8_t exerciseMachineRotationDetector = 0;
 extern uint8_t leftMotor;
 extern uint8_t rightMotor;
 extern uint32_t lastRumbleOff;
+extern HIDJoystick* curJoystick;
+extern USBXBox360Controller* curX360;
  
 const uint32_t watchdogSeconds = 10; // do not make it be below 6
 
@@ -126,14 +167,20 @@ const uint32_t rotationDetector = PA7;
 #ifdef ENABLE_EXERCISE_MACHINE
 #define directionSwitch PA8
 #endif
+const uint32_t crankDetector = PB8;
+const uint32_t heartRateDetector = PB9;
+const uint32_t resistanceKnob = PB0;
 
 gpio_dev* const ledPort = GPIOB;
 const uint8_t ledPin = 12;
 const uint8_t ledPinID = PB12;
 
 const uint32_t saveInjectionModeAfterMillis = 15000ul; // only save a mode if it's been used 15 seconds; this saves flash
+const uint32_t eraseSettingsAfterIdleMillis = 2000ul; // only erase the settings flash page, which stalls everything, when the controls are idle
+const int32_t idleTolerance = 16; // stick, shoulder and exercise machine speed changes up to this are noise, not use of the controls
 
 const uint32_t gcPinID = PA6;
+const uint32_t pollPeriodMicros = 5000;
 
 int32_t injectionMode = 0;
 uint32_t savedInjectionMode = 0;
@@ -176,10 +223,20 @@ const int numberOfButtons = 2*numberOfUnshiftedButtons;
 #define MOUSE_RELATIVE 'm'
 #define CLICK 'c'
 #define SHIFT 's'
+#define TURBO 't'
+#define MACRO 'M'
 
 typedef void (*GameControllerDataProcessor_t)(const GameControllerData_t* data);
 typedef void (*ExerciseMachineProcessor_t)(const GameControllerData_t* data, const ExerciseMachineData_t* exerciseMachine, int32_t multiplier);
 
+// One step of a MACRO button: hold a joystick button (JOY) or key (KEY) for duration ms,
+// or just wait (UNDEFINED). A step with duration 0 ends the macro.
+typedef struct {
+  char mode;
+  uint8_t value;
+  uint16_t duration;
+} MacroStep_t;
+
 typedef struct {
   char mode;
   union {
@@ -195,12 +252,81 @@ typedef struct {
       int16_t y;
     } mouseRelative;
     GameControllerDataProcessor_t processor;
+    struct {
+      uint8_t button;
+      uint8_t halfPeriod; // ms pressed, then ms released; 0 is taken as 1
+    } turbo;
+    const MacroStep_t* macro;
   } value;
 } InjectedButton_t;
 
+// Button maps are stored in flash as sparse lists of 2-byte PackedButton_t entries, ended by
+// PACKED_END, and are decoded into a full InjectedButton_t[numberOfButtons] in RAM only when
+// the mode changes. Buttons not listed are UNDEFINED. Modes that don't fit in a byte live in
+// extendedButtons[], and runs of entries shared by several maps live in packedIncludes[].
+// The tables are written by hand with the PACK_* macros below; "make -C test sizes" lists how
+// big they come out.
+typedef uint16_t PackedButton_t;
+
+#define PACKED_JOY      0
+#define PACKED_KEY      1
+#define PACKED_EXTENDED 2 // value is an index into extendedButtons[]
+#define PACKED_INCLUDE  3 // value is an index into packedIncludes[]
+
+// bits 0-5: button index, bits 6-7: kind, bits 8-15: value
+#define PACK_BUTTON(kind, index, value) ((PackedButton_t)((index) | ((kind) << 6) | ((uint16_t)(uint8_t)(value) << 8)))
+#define PACK_JOY(index, button) PACK_BUTTON(PACKED_JOY, index, button)
+#define PACK_KEY(index, key) PACK_BUTTON(PACKED_KEY, index, key)
+#define PACK_EXTENDED(index, n) PACK_BUTTON(PACKED_EXTENDED, index, n)
+#define PACK_INCLUDE(n) PACK_BUTTON(PACKED_INCLUDE, 0, n)
+#define PACKED_END ((PackedButton_t)0xFFFF)
+
+#define PACKED_INDEX(p) ((p) & 0x3F)
+#define PACKED_KIND(p) (((p) >> 6) & 3)
+#define PACKED_VALUE(p) ((uint8_t)((p) >> 8))
+
+static_assert(numberOfButtons <= 0x3F, "button index must fit in 6 bits");
+
+const uint16_t gcA = 0;
+const uint16_t gcB = 1;
+const uint16_t gcX = 2;
+const uint16_t gcY = 3;
+const uint16_t gcStart = 4;
+const uint16_t gcDLeft = 5;
+const uint16_t gcDRight = 6;
+const uint16_t gcDDown = 7;
+const uint16_t gcDUp = 8;
+const uint16_t gcZ = 9;
+const uint16_t gcShoulderRight = 10;
+const uint16_t gcShoulderLeft = 11;
+#define SHIFTED(index) ((index) + numberOfUnshiftedButtons)
+
+#define EXERCISE_SPEED      1
+#define EXERCISE_CADENCE    2
+#define EXERCISE_HEART_RATE 3
+#define EXERCISE_RESISTANCE 4
+
+#define AXIS_SLIDER_LEFT  1
+#define AXIS_SLIDER_RIGHT 2
+#define AXIS_X_ROTATE     3
+#define AXIS_Y_ROTATE     4
+
+#define CURVE_LINEAR 0
+#define CURVE_SQUARE 1 // finer control at low values
+#define CURVE_SQRT   2 // finer control at high values
+
+// Maps one exercise machine channel to a joystick axis. Speed and cadence are centered on 512
+// and signed by the direction switch; heart rate and resistance go from 0 up.
+typedef struct {
+  uint8_t channel; // 0 ends a list
+  uint8_t axis;
+  uint8_t curve;
+  int16_t multiplier; // 64 = default; higher is faster
+} ExerciseAxis_t;
+
 typedef struct {
   const USBMode_t* usbMode;
-  InjectedButton_t const * buttons;
+  PackedButton_t const * buttons;
   GameControllerDataProcessor_t stick;
   ExerciseMachineProcessor_t exerciseMachine;
   int32_t exerciseMachineMultiplier; // 64 = default speed ; higher is faster
@@ -210,6 +336,7 @@ typedef struct {
   bool show;
   bool rumble;
   bool dpadToJoystick;
+  const ExerciseAxis_t* exerciseAxes; // applied after exerciseMachine; may be NULL
 } Injector_t;
 
 
@@ -219,321 +346,263 @@ void joystickUnifiedShoulder(const GameControllerData_t* data);
 void joystickBasic(const GameControllerData_t* data);
 void exerciseMachineSliders(const GameControllerData_t* data, const ExerciseMachineData_t* exerciseMachineP, int32_t multiplier);
 void directionSwitchSlider(const GameControllerData_t* data, const ExerciseMachineData_t* exerciseMachineP, int32_t multiplier);
+void exerciseMachineAxes(const ExerciseAxis_t* axes, const ExerciseMachineData_t* exerciseMachineP);
+void pressJoystickButton(uint8_t b);
+void macroStart(const MacroStep_t* macro, uint32_t t);
+void macroUpdate(uint32_t t);
+void macroStopAll(void);
+bool macroActive(void);
+
+const MacroStep_t macroAThenB[] = {
+    { JOY, 1, 50 },
+    { UNDEFINED, 0, 30 },
+    { JOY, 2, 50 },
+    { UNDEFINED, 0, 0 }
+};
+
+enum {
+  EXTENDED_SHIFT,
+  EXTENDED_SWITCH_ZR_OR_A,
+  EXTENDED_CLICK_LEFT,
+  EXTENDED_CLICK_RIGHT,
+  EXTENDED_MOUSE_LEFT,
+  EXTENDED_MOUSE_RIGHT,
+  EXTENDED_TURBO_1,
+  EXTENDED_TURBO_2,
+  EXTENDED_MACRO_A_THEN_B,
+};
+
+const InjectedButton_t extendedButtons[] = {
+    { SHIFT },
+    { JOY_SWITCHABLE, {.joySwitchable = {.upButton = HIDSwitchController::BUTTON_ZR, .downButton = HIDSwitchController::BUTTON_A } } },
+    { CLICK, {.buttons = 0x01 } },
+    { CLICK, {.buttons = 0x02 } }, // TODO: check button number
+    { MOUSE_RELATIVE, {.mouseRelative = {-50,0} } },
+    { MOUSE_RELATIVE, {.mouseRelative = {50,0} } },
+    { TURBO, {.turbo = { .button = 1, .halfPeriod = 33 } } },
+    { TURBO, {.turbo = { .button = 2, .halfPeriod = 33 } } },
+    { MACRO, {.macro = macroAThenB } },
+};
+
+const PackedButton_t arrowKeys[] = {
+    PACK_KEY(gcDLeft, KEY_LEFT_ARROW),
+    PACK_KEY(gcDRight, KEY_RIGHT_ARROW),
+    PACK_KEY(gcDDown, KEY_DOWN_ARROW),
+    PACK_KEY(gcDUp, KEY_UP_ARROW),
+    PACK_KEY(virtualLeft, KEY_LEFT_ARROW),
+    PACK_KEY(virtualRight, KEY_RIGHT_ARROW),
+    PACK_KEY(virtualDown, KEY_DOWN_ARROW),
+    PACK_KEY(virtualUp, KEY_UP_ARROW),
+    PACKED_END
+};
+
+enum {
+  INCLUDE_ARROW_KEYS,
+};
+
+const PackedButton_t* const packedIncludes[] = {
+    arrowKeys,
+};
+
+const ExerciseAxis_t bikeSensorAxes[] = {
+    { EXERCISE_SPEED, AXIS_SLIDER_LEFT, CURVE_LINEAR, 64 },
+    { EXERCISE_CADENCE, AXIS_SLIDER_RIGHT, CURVE_LINEAR, 64 },
+    { EXERCISE_HEART_RATE, AXIS_X_ROTATE, CURVE_LINEAR, 64 },
+    { EXERCISE_RESISTANCE, AXIS_Y_ROTATE, CURVE_SQUARE, 64 },
+    { 0 }
+};
 
 // note: Nunchuck Z maps to A, Nunchuck C maps to B
-const InjectedButton_t defaultJoystickButtons[numberOfButtons] = {
-    { JOY, {.button = 1} },           // A
-    { JOY, {.button = 2} },           // B
-    { JOY, {.button = 3} },           // X
-    { JOY, {.button = 4} },           // Y
-    { JOY, {.button = 5} },           // Start
-    { 0,   {.key = 0 } },             // DLeft
-    { 0,   {.key = 0 } },             // DRight
-    { 0,   {.key = 0 } },             // DDown
-    { 0,   {.key = 0 } },             // DUp
-    { JOY, {.button = 6 } },          // Z
-    { 0, {.key = 0 } }, //{ JOY, {.button = 8 } },           // right shoulder button
-    { 0, {.key = 0 } }, //{ JOY, {.button = 7 } },           // left shoulder button
-    { 0,   {.key = 0 } },           // right shoulder button partial
-    { 0,   {.key = 0 } },           // left shoulder button partial
-    { 0,   {.key = 0 } },           // virtual left
-    { 0,   {.key = 0 } },           // virtual right
-    { 0,   {.key = 0 } },           // virtual down
-    { 0,   {.key = 0 } },           // virtual up
+const PackedButton_t defaultJoystickButtons[] = {
+    PACK_JOY(gcA, 1),
+    PACK_JOY(gcB, 2),
+    PACK_JOY(gcX, 3),
+    PACK_JOY(gcY, 4),
+    PACK_JOY(gcStart, 5),
+    PACK_JOY(gcZ, 6),
+    //PACK_JOY(gcShoulderRight, 8),
+    //PACK_JOY(gcShoulderLeft, 7),
+    PACKED_END
+};
+
+const PackedButton_t turboJoystickButtons[] = {
+    PACK_EXTENDED(gcA, EXTENDED_TURBO_1),
+    PACK_EXTENDED(gcB, EXTENDED_TURBO_2),
+    PACK_EXTENDED(gcX, EXTENDED_MACRO_A_THEN_B),
+    PACK_JOY(gcY, 4),
+    PACK_JOY(gcStart, 5),
+    PACK_JOY(gcZ, 6),
+    PACKED_END
 };
 
-const InjectedButton_t outfox[numberOfButtons] = {
-    { JOY, {.button = 1} },           // A
-    { JOY, {.button = 2} },           // B
-    { JOY, {.button = 3} },           // X
-    { JOY, {.button = 4} },           // Y
-    { JOY, {.button = 5} },           // Start
-    { JOY,   {.button = 6 } },             // DLeft
-    { JOY,   {.button = 7 } },             // DRight
-    { JOY,   {.button = 8 } },             // DDown
-    { JOY,   {.button = 9 } },             // DUp
-    { JOY, {.button = 10 } },          // Z
-    { JOY, {.button = 11} },            // right shoulder button
-    { JOY, {.button = 12} },           // left shoulder button
-    { JOY,   {.button = 13 } },           // right shoulder button partial
-    { JOY,   {.button = 14 } },           // left shoulder button partial
-    { 0,   {.key = 0 } },           // virtual left
-    { 0,   {.key = 0 } },           // virtual right
-    { 0,   {.key = 0 } },           // virtual down
-    { 0,   {.key = 0 } },           // virtual up
+const PackedButton_t outfox[] = {
+    PACK_JOY(gcA, 1),
+    PACK_JOY(gcB, 2),
+    PACK_JOY(gcX, 3),
+    PACK_JOY(gcY, 4),
+    PACK_JOY(gcStart, 5),
+    PACK_JOY(gcDLeft, 6),
+    PACK_JOY(gcDRight, 7),
+    PACK_JOY(gcDDown, 8),
+    PACK_JOY(gcDUp, 9),
+    PACK_JOY(gcZ, 10),
+    PACK_JOY(gcShoulderRight, 11),
+    PACK_JOY(gcShoulderLeft, 12),
+    PACK_JOY(virtualShoulderRightPartial, 13),
+    PACK_JOY(virtualShoulderLeftPartial, 14),
+    PACKED_END
 };
 
 // unsupported: XBox back, XBox left bumper, XBox button, stick buttons
-const InjectedButton_t defaultXBoxButtons[numberOfButtons] = {
-    { JOY, {.button = XBOX_A} },           // A
-    { JOY, {.button = XBOX_B} },           // B
-    { JOY, {.button = XBOX_X} },           // X
-    { JOY, {.button = XBOX_Y} },           // Y
-    { JOY, {.button = XBOX_START} },           // Start 
-    { JOY, {.button = XBOX_DLEFT } },             // DLeft
-    { JOY, {.button = XBOX_DRIGHT } },             // DRight
-    { JOY, {.button = XBOX_DDOWN } },             // DDown
-    { JOY, {.button = XBOX_DUP } },             // DUp
-    { JOY, {.button = XBOX_RSHOULDER } },          // Z
-    { JOY, {.key = XBOX_R3 } }, //{ JOY, {.button = 8 } },           // right shoulder button
-    { JOY, {.key = XBOX_L3 } }, //{ JOY, {.button = 7 } },           // left shoulder button
-    { 0,   {.key = 0 } },           // right shoulder button partial
-    { 0,   {.key = 0 } },           // left shoulder button partial
-    { 0,   {.key = 0 } },           // virtual left
-    { 0,   {.key = 0 } },           // virtual right
-    { 0,   {.key = 0 } },           // virtual down
-    { 0,   {.key = 0 } },           // virtual up
+const PackedButton_t defaultXBoxButtons[] = {
+    PACK_JOY(gcA, XBOX_A),
+    PACK_JOY(gcB, XBOX_B),
+    PACK_JOY(gcX, XBOX_X),
+    PACK_JOY(gcY, XBOX_Y),
+    PACK_JOY(gcStart, XBOX_START),
+    PACK_JOY(gcDLeft, XBOX_DLEFT),
+    PACK_JOY(gcDRight, XBOX_DRIGHT),
+    PACK_JOY(gcDDown, XBOX_DDOWN),
+    PACK_JOY(gcDUp, XBOX_DUP),
+    PACK_JOY(gcZ, XBOX_RSHOULDER),
+    PACK_JOY(gcShoulderRight, XBOX_R3),
+    PACK_JOY(gcShoulderLeft, XBOX_L3),
+    PACKED_END
 };
 
-const InjectedButton_t defaultSwitchButtons[numberOfButtons] = {
-    { JOY, {.button = HIDSwitchController::BUTTON_A} },           // A
-    { JOY, {.button = HIDSwitchController::BUTTON_B} },           // B
-    { JOY, {.button = HIDSwitchController::BUTTON_X} },           // X
-    { JOY, {.button = HIDSwitchController::BUTTON_Y} },           // Y
-    { SHIFT },        // Start 
-    { 0,   {.key = 0 } },             // DLeft
-    { 0,   {.key = 0 } },             // DRight
-    { 0,   {.key = 0 } },             // DDown
-    { 0,   {.key = 0 } },             // DUp
-    { JOY, {.button = HIDSwitchController::BUTTON_R } },          // Z
-    { JOY_SWITCHABLE, {.joySwitchable = {.upButton = HIDSwitchController::BUTTON_ZR, .downButton = HIDSwitchController::BUTTON_A } } }, // right shoulder button
-    { 0, {.key = 0 } }, // left shoulder button
-    { JOY, {.button = HIDSwitchController::BUTTON_ZR } },           // right shoulder button partial
-    { JOY, {.button = HIDSwitchController::BUTTON_ZL } },           // left shoulder button partial
-    { 0,   {.key = 0 } },           // virtual left
-    { 0,   {.key = 0 } },           // virtual right
-    { 0,   {.key = 0 } },           // virtual down
-    { 0,   {.key = 0 } },           // virtual up
+const PackedButton_t defaultSwitchButtons[] = {
+    PACK_JOY(gcA, HIDSwitchController::BUTTON_A),
+    PACK_JOY(gcB, HIDSwitchController::BUTTON_B),
+    PACK_JOY(gcX, HIDSwitchController::BUTTON_X),
+    PACK_JOY(gcY, HIDSwitchController::BUTTON_Y),
+    PACK_EXTENDED(gcStart, EXTENDED_SHIFT),
+    PACK_JOY(gcZ, HIDSwitchController::BUTTON_R),
+    PACK_EXTENDED(gcShoulderRight, EXTENDED_SWITCH_ZR_OR_A),
+    PACK_JOY(virtualShoulderRightPartial, HIDSwitchController::BUTTON_ZR),
+    PACK_JOY(virtualShoulderLeftPartial, HIDSwitchController::BUTTON_ZL),
 // shifted
-    { JOY, {.button = HIDSwitchController::BUTTON_CAPTURE }  },           // A
-    { JOY, {.button = HIDSwitchController::BUTTON_HOME } },           // B
-    { JOY, {.button = HIDSwitchController::BUTTON_RIGHT_CLICK } },           // X
-    { JOY, {.button = HIDSwitchController::BUTTON_LEFT_CLICK } },           // Y
-    { JOY, {.button = HIDSwitchController::BUTTON_PLUS } },           // Start
-    { 0,   {.key = 0 } },             // DLeft
-    { 0,   {.key = 0 } },             // DRight
-    { 0,   {.key = 0 } },             // DDown
-    { 0,   {.key = 0 } },             // DUp
-    { JOY, {.button = HIDSwitchController::BUTTON_MINUS } },          // Z
-    { 0, {.key = 0 } }, // right shoulder button
-    { 0, {.key = 0 } }, // left shoulder button
-    { JOY, {.button = HIDSwitchController::BUTTON_R } },           // right shoulder button partial
-    { JOY, {.button = HIDSwitchController::BUTTON_L } },           // left shoulder button partial
-    { 0,   {.key = 0 } },           // virtual left
-    { 0,   {.key = 0 } },           // virtual right
-    { 0,   {.key = 0 } },           // virtual down
-    { 0,   {.key = 0 } }            // virtual up
+    PACK_JOY(SHIFTED(gcA), HIDSwitchController::BUTTON_CAPTURE),
+    PACK_JOY(SHIFTED(gcB), HIDSwitchController::BUTTON_HOME),
+    PACK_JOY(SHIFTED(gcX), HIDSwitchController::BUTTON_RIGHT_CLICK),
+    PACK_JOY(SHIFTED(gcY), HIDSwitchController::BUTTON_LEFT_CLICK),
+    PACK_JOY(SHIFTED(gcStart), HIDSwitchController::BUTTON_PLUS),
+    PACK_JOY(SHIFTED(gcZ), HIDSwitchController::BUTTON_MINUS),
+    PACK_JOY(SHIFTED(virtualShoulderRightPartial), HIDSwitchController::BUTTON_R),
+    PACK_JOY(SHIFTED(virtualShoulderLeftPartial), HIDSwitchController::BUTTON_L),
+    PACKED_END
 };
 
-const InjectedButton_t jetsetJoystickButtons[numberOfButtons] = {
-    { JOY, {.button = 1} },           // A
-    { JOY, {.button = 2} },           // B
-    { JOY, {.button = 5} },           // X
-    { JOY, {.button = 3} },           // Y
-    { JOY, {.button = 8} },           // Start
-    { 0,   {.key = 0 } },             // DLeft
-    { 0,   {.key = 0 } },             // DRight
-    { 0,   {.key = 0 } },             // DDown
-    { 0,   {.key = 0 } },             // DUp
-    { JOY, {.button = 4 } },          // Z
-    { 0,   {.key = 0 } },           // right shoulder button
-    { 0,   {.key = 0 } },           // left shoulder button
-    { JOY, {.button = 6 } },           // right shoulder button partial
-    { JOY,   {.button = 5 } },         // left shoulder button partial (was 7)
-    { 0,   {.key = 0 } },           // virtual left
-    { 0,   {.key = 0 } },           // virtual right
-    { 0,   {.key = 0 } },           // virtual down
-    { 0,   {.key = 0 } },           // virtual up
+const PackedButton_t jetsetJoystickButtons[] = {
+    PACK_JOY(gcA, 1),
+    PACK_JOY(gcB, 2),
+    PACK_JOY(gcX, 5),
+    PACK_JOY(gcY, 3),
+    PACK_JOY(gcStart, 8),
+    PACK_JOY(gcZ, 4),
+    PACK_JOY(virtualShoulderRightPartial, 6),
+    PACK_JOY(virtualShoulderLeftPartial, 5), // was 7
+    PACKED_END
 };
 
-const InjectedButton_t dpadWASDButtons[numberOfButtons] = {
-    { KEY, {.key = ' '} },          // A
-    { KEY, {.key = KEY_RETURN} },   // B
-    { 0,   {.key = 0 } },           // X
-    { 0,   {.key = 0 } },           // Y
-    { 0,   {.key = 0 } },           // Start
-    { KEY, {.key = 'a' } },         // DLeft
-    { KEY, {.key = 'd' } },         // DRight
-    { KEY, {.key = 's' } },         // DDown
-    { KEY, {.key = 'w' } },         // DUp
-    { 0,   {.key = 0 } },           // Z
-    { 0,   {.key = 0 } },           // right shoulder button
-    { 0,   {.key = 0 } },           // left shoulder button
-    { 0,   {.key = 0 } },           // right shoulder button partial
-    { 0,   {.key = 0 } },           // left shoulder button partial
-    { KEY,   {.key = 'a' } },           // virtual left
-    { KEY,   {.key = 'd' } },           // virtual right
-    { KEY,   {.key = 's' } },           // virtual down
-    { KEY,   {.key = 'w' } },           // virtual up
+const PackedButton_t dpadWASDButtons[] = {
+    PACK_KEY(gcA, ' '),
+    PACK_KEY(gcB, KEY_RETURN),
+    PACK_KEY(gcDLeft, 'a'),
+    PACK_KEY(gcDRight, 'd'),
+    PACK_KEY(gcDDown, 's'),
+    PACK_KEY(gcDUp, 'w'),
+    PACK_KEY(virtualLeft, 'a'),
+    PACK_KEY(virtualRight, 'd'),
+    PACK_KEY(virtualDown, 's'),
+    PACK_KEY(virtualUp, 'w'),
+    PACKED_END
 };
 
-const InjectedButton_t powerPadLeft[numberOfButtons] = {
-    { KEY, {.key = 'q'} },          // A
-    { KEY, {.key = 'z'} },   // B
-    { 0,   {.key = 0 } },           // X
-    { 0,   {.key = 0 } },           // Y
-    { KEY,   {.key = '=' } },           // Start
-    { KEY, {.key = 'x' } },         // DLeft
-    { KEY, {.key = 'w' } },         // DRight
-    { KEY, {.key = 'd' } },         // DDown
-    { KEY, {.key = 'a' } },         // DUp
-    { KEY, {.key = '-'} },           // Z
-    { 0,   {.key = 0 } },           // right shoulder button
-    { 0,   {.key = 0 } },           // left shoulder button
-    { 0,   {.key = 0 } },           // right shoulder button partial
-    { 0,   {.key = 0 } },           // left shoulder button partial
-    { 0,   {.key = 0 } },           // virtual left
-    { 0,   {.key = 0 } },           // virtual right
-    { 0,   {.key = 0 } },           // virtual down
-    { 0,   {.key = 0 } },           // virtual up
+const PackedButton_t powerPadLeft[] = {
+    PACK_KEY(gcA, 'q'),
+    PACK_KEY(gcB, 'z'),
+    PACK_KEY(gcStart, '='),
+    PACK_KEY(gcDLeft, 'x'),
+    PACK_KEY(gcDRight, 'w'),
+    PACK_KEY(gcDDown, 'd'),
+    PACK_KEY(gcDUp, 'a'),
+    PACK_KEY(gcZ, '-'),
+    PACKED_END
 };
 
-const InjectedButton_t dpadWASZButtons[numberOfButtons] = {
-    { KEY, {.key = ' '} },          // A
-    { KEY, {.key = KEY_RETURN} },   // B
-    { 0,   {.key = 0 } },           // X
-    { 0,   {.key = 0 } },           // Y
-    { 0,   {.key = 0 } },           // Start
-    { KEY, {.key = 'a' } },         // DLeft
-    { KEY, {.key = 's' } },         // DRight
-    { KEY, {.key = 'z' } },         // DDown
-    { KEY, {.key = 'w' } },         // DUp
-    { 0,   {.key = 0 } },           // Z
-    { 0,   {.key = 0 } },           // right shoulder button
-    { 0,   {.key = 0 } },           // left shoulder button
-    { 0,   {.key = 0 } },           // right shoulder button partial
-    { 0,   {.key = 0 } },           // left shoulder button partial
-    { KEY,   {.key = 'a' } },           // virtual left
-    { KEY,   {.key = 's' } },           // virtual right
-    { KEY,   {.key = 'z' } },           // virtual down
-    { KEY,   {.key = 'w' } },           // virtual up
+const PackedButton_t dpadWASZButtons[] = {
+    PACK_KEY(gcA, ' '),
+    PACK_KEY(gcB, KEY_RETURN),
+    PACK_KEY(gcDLeft, 'a'),
+    PACK_KEY(gcDRight, 's'),
+    PACK_KEY(gcDDown, 'z'),
+    PACK_KEY(gcDUp, 'w'),
+    PACK_KEY(virtualLeft, 'a'),
+    PACK_KEY(virtualRight, 's'),
+    PACK_KEY(virtualDown, 'z'),
+    PACK_KEY(virtualUp, 'w'),
+    PACKED_END
 };
 
-const InjectedButton_t dpadArrowWithCTRL[numberOfButtons] = {
-    { KEY, {.key = KEY_LEFT_CTRL} },          // A
-    { KEY, {.key = ' '} },          // B
-    { 0,   {.key = 0 } },           // X
-    { 0,   {.key = 0 } },           // Y
-    { KEY, {.key = '+' } },           // Start
-    { KEY, {.key = KEY_LEFT_ARROW } },         // DLeft
-    { KEY, {.key = KEY_RIGHT_ARROW } },         // DRight
-    { KEY, {.key = KEY_DOWN_ARROW  } },         // DDown
-    { KEY, {.key = KEY_UP_ARROW  } },         // DUp
-    { KEY, {.key = '-' } },           // Z
-    { 0,   {.key = 0 } },           // right shoulder button
-    { 0,   {.key = 0 } },           // left shoulder button
-    { 0,   {.key = 0 } },           // right shoulder button partial
-    { 0,   {.key = 0 } },           // left shoulder button partial
-    { KEY,   {.key = KEY_LEFT_ARROW } },           // virtual left
-    { KEY,   {.key = KEY_RIGHT_ARROW } },           // virtual right
-    { KEY,   {.key = KEY_DOWN_ARROW } },           // virtual down
-    { KEY,   {.key = KEY_UP_ARROW } },           // virtual up
+const PackedButton_t dpadArrowWithCTRL[] = {
+    PACK_KEY(gcA, KEY_LEFT_CTRL),
+    PACK_KEY(gcB, ' '),
+    PACK_KEY(gcStart, '+'),
+    PACK_KEY(gcZ, '-'),
+    PACK_INCLUDE(INCLUDE_ARROW_KEYS),
+    PACKED_END
 };
 
-
-const InjectedButton_t mame[numberOfButtons] = {
-    { KEY, {.key = KEY_LEFT_CTRL} },          // A
-    { KEY, {.key = KEY_LEFT_ALT} },          // B
-    { 0,   {.key = ' ' } },           // X
-    { 0,   {.key = KEY_LEFT_SHIFT } },           // Y
-    { KEY, {.key = '1' } },           // Start 1 player
-    { KEY, {.key = KEY_LEFT_ARROW } },         // DLeft
-    { KEY, {.key = KEY_RIGHT_ARROW } },         // DRight
-    { KEY, {.key = KEY_DOWN_ARROW  } },         // DDown
-    { KEY, {.key = KEY_UP_ARROW  } },         // DUp
-    { KEY, {.key = '5' } },           // Z
-    { 0,   {.key = 0 } },           // right shoulder button
-    { 0,   {.key = 0 } },           // left shoulder button
-    { 0,   {.key = 0 } },           // right shoulder button partial
-    { 0,   {.key = 0 } },           // left shoulder button partial
-    { KEY,   {.key = KEY_LEFT_ARROW } },           // virtual left
-    { KEY,   {.key = KEY_RIGHT_ARROW } },           // virtual right
-    { KEY,   {.key = KEY_DOWN_ARROW } },           // virtual down
-    { KEY,   {.key = KEY_UP_ARROW } },           // virtual up
+const PackedButton_t mame[] = {
+    PACK_KEY(gcA, KEY_LEFT_CTRL),
+    PACK_KEY(gcB, KEY_LEFT_ALT),
+    //PACK_KEY(gcX, ' '),
+    //PACK_KEY(gcY, KEY_LEFT_SHIFT),
+    PACK_KEY(gcStart, '1'), // 1 player
+    PACK_KEY(gcZ, '5'),
+    PACK_INCLUDE(INCLUDE_ARROW_KEYS),
+    PACKED_END
 };
 
-const InjectedButton_t dpadZX[numberOfButtons] = {
-    { KEY, {.key = 'z'} },          // A
-    { KEY, {.key = 'x'} },          // B
-    { KEY, {.key = ' ' } },           // X
-    { KEY, {.key = KEY_RIGHT_SHIFT } },           // Y
-    { KEY, {.key = KEY_RETURN } },           // Start
-    { KEY, {.key = KEY_LEFT_ARROW } },         // DLeft
-    { KEY, {.key = KEY_RIGHT_ARROW } },         // DRight
-    { KEY, {.key = KEY_DOWN_ARROW  } },         // DDown
-    { KEY, {.key = KEY_UP_ARROW  } },         // DUp
-    { KEY, {.key = '-' } },           // Z
-    { 0,   {.key = 0 } },           // right shoulder button
-    { 0,   {.key = 0 } },           // left shoulder button
-    { 0,   {.key = 0 } },           // right shoulder button partial
-    { 0,   {.key = 0 } },           // left shoulder button partial
-    { KEY,   {.key = KEY_LEFT_ARROW } },           // virtual left
-    { KEY,   {.key = KEY_RIGHT_ARROW } },           // virtual right
-    { KEY,   {.key = KEY_DOWN_ARROW } },           // virtual down
-    { KEY,   {.key = KEY_UP_ARROW } },           // virtual up
+const PackedButton_t dpadZX[] = {
+    PACK_KEY(gcA, 'z'),
+    PACK_KEY(gcB, 'x'),
+    PACK_KEY(gcX, ' '),
+    PACK_KEY(gcY, KEY_RIGHT_SHIFT),
+    PACK_KEY(gcStart, KEY_RETURN),
+    PACK_KEY(gcZ, '-'),
+    PACK_INCLUDE(INCLUDE_ARROW_KEYS),
+    PACKED_END
 };
 
-const InjectedButton_t dpadArrowWithSpace[numberOfButtons] = {
-    { KEY, {.key = ' '} },          // A
-    { KEY, {.key = KEY_BACKSPACE} }, // B
-    { 0,   {.key = 0 } },           // X
-    { 0,   {.key = 0 } },           // Y
-    { KEY, {.key = '+' } },           // Start
-    { KEY, {.key = KEY_LEFT_ARROW } },         // DLeft
-    { KEY, {.key = KEY_RIGHT_ARROW } },         // DRight
-    { KEY, {.key = KEY_DOWN_ARROW  } },         // DDown
-    { KEY, {.key = KEY_UP_ARROW  } },         // DUp
-    { KEY, {.key = '-' } },           // Z
-    { 0,   {.key = 0 } },           // right shoulder button
-    { 0,   {.key = 0 } },           // left shoulder button
-    { 0,   {.key = 0 } },           // right shoulder button partial
-    { 0,   {.key = 0 } },           // left shoulder button partial
-    { KEY,   {.key = KEY_LEFT_ARROW } },           // virtual left
-    { KEY,   {.key = KEY_RIGHT_ARROW } },           // virtual right
-    { KEY,   {.key = KEY_DOWN_ARROW } },           // virtual down
-    { KEY,   {.key = KEY_UP_ARROW } },           // virtual up
+const PackedButton_t dpadArrowWithSpace[] = {
+    PACK_KEY(gcA, ' '),
+    PACK_KEY(gcB, KEY_BACKSPACE),
+    PACK_KEY(gcStart, '+'),
+    PACK_KEY(gcZ, '-'),
+    PACK_INCLUDE(INCLUDE_ARROW_KEYS),
+    PACKED_END
 };
 
-const InjectedButton_t dpadQBert[numberOfButtons] = {
-    { KEY, {.key = '1'} },          // A
-    { KEY, {.key = '2'} },          // B
-    { 0,   {.key = 0 } },           // X
-    { 0,   {.key = 0 } },           // Y
-    { KEY, {.key = '+' } },           // Start
-    { KEY, {.key = KEY_LEFT_ARROW } },         // DLeft
-    { KEY, {.key = KEY_RIGHT_ARROW } },         // DRight
-    { KEY, {.key = KEY_DOWN_ARROW  } },         // DDown
-    { KEY, {.key = KEY_UP_ARROW  } },         // DUp
-    { KEY, {.key = '-' } },           // Z
-    { 0,   {.key = 0 } },           // right shoulder button
-    { 0,   {.key = 0 } },           // left shoulder button
-    { 0,   {.key = 0 } },           // right shoulder button partial
-    { 0,   {.key = 0 } },           // left shoulder button partial
-    { KEY,   {.key = KEY_LEFT_ARROW } },           // virtual left
-    { KEY,   {.key = KEY_RIGHT_ARROW } },           // virtual right
-    { KEY,   {.key = KEY_DOWN_ARROW } },           // virtual down
-    { KEY,   {.key = KEY_UP_ARROW } },           // virtual up
+const PackedButton_t dpadQBert[] = {
+    PACK_KEY(gcA, '1'),
+    PACK_KEY(gcB, '2'),
+    PACK_KEY(gcStart, '+'),
+    PACK_KEY(gcZ, '-'),
+    PACK_INCLUDE(INCLUDE_ARROW_KEYS),
+    PACKED_END
 };
 
-const InjectedButton_t dpadMC[numberOfButtons] = {
-    { KEY, {.key = ' '} },          // A
-    { KEY, {.key = KEY_LEFT_SHIFT} }, // B
-    { 0,   {.key = 0 } },           // X
-    { 0,   {.key = 0 } },           // Y
-    { CLICK, {.buttons = 0x02 } },           // Start // TODO: check button number
-    { MOUSE_RELATIVE, {.mouseRelative = {-50,0} } },         // DLeft
-    { MOUSE_RELATIVE, {.mouseRelative = {50,0} } },         // DRight
-    { KEY, {.key = 's' } },         // DDown
-    { KEY, {.key = 'w' } },         // DUp
-    { CLICK, {.buttons = 0x01 } },           // Z
-    { 0,   {.key = 0 } },           // right shoulder button
-    { 0,   {.key = 0 } },           // left shoulder button
-    { 0,   {.key = 0 } },           // right shoulder button partial
-    { 0,   {.key = 0 } },           // left shoulder button partial
-    { 0,   {.key = 0 } },           // virtual left
-    { 0,   {.key = 0 } },           // virtual right
-    { 0,   {.key = 0 } },           // virtual down
-    { 0,   {.key = 0 } },           // virtual up
+const PackedButton_t dpadMC[] = {
+    PACK_KEY(gcA, ' '),
+    PACK_KEY(gcB, KEY_LEFT_SHIFT),
+    PACK_EXTENDED(gcStart, EXTENDED_CLICK_RIGHT),
+    PACK_EXTENDED(gcDLeft, EXTENDED_MOUSE_LEFT),
+    PACK_EXTENDED(gcDRight, EXTENDED_MOUSE_RIGHT),
+    PACK_KEY(gcDDown, 's'),
+    PACK_KEY(gcDUp, 'w'),
+    PACK_EXTENDED(gcZ, EXTENDED_CLICK_LEFT),
+    PACKED_END
 };
 
 const USBMode_t modeUSBHID = {
@@ -590,11 +659,15 @@ const Injector_t injectors[] {
   { &modeUSBHID, dpadWASZButtons, NULL, exerciseMachineSliders, 64, "wasz", "WASZ", 4, false },
 #if defined(ENABLE_GAMECUBE) && defined(ENABLE_NUNCHUCK)
   { &modeDualX360, defaultXBoxButtons, joystickDualShoulder, exerciseMachineSliders, 64, "dualx360", "dual XBox360", 8, true }, 
+#endif
+  { &modeUSBHID, turboJoystickButtons, joystickUnifiedShoulder, exerciseMachineSliders, 64, "turbo", "joystick, turbo A/B, X=A,B macro", 8, false },
+#ifdef ENABLE_EXERCISE_MACHINE
+  { &modeUSBHID, defaultJoystickButtons, joystickNoShoulder, NULL, 64, "bikeSensors", "joystick, bike speed/cadence/heart rate/resistance", 8, false, false, false, bikeSensorAxes },
 #endif
 };
 
 const uint32_t numInjectionModes = sizeof(injectors)/sizeof(*injectors);
-void inject(HIDJoystick* joy, const Injector_t* injector, const GameControllerData_t* curDataP, const ExerciseMachineData_t* exerciseMachineP);
+bool inject(HIDJoystick* joy, USBXBox360Controller* xbox, const Injector_t* injector, const GameControllerData_t* curDataP, const ExerciseMachineData_t* exerciseMachineP);
 
 static inline bool isModeX360() {
   return currentUSBMode == &modeX360 || currentUSBMode == &modeDualX360;
@@ -609,4 +682,4 @@ static inline bool isModeSwitch() {
 }
 
 #endif // _GAMECUBE_H
-
+
@@ -35,6 +35,11 @@
 // PA8 - direction control switch, one side
 // 3.3V - direction control switch, other side
 
+// Optional extra exercise machine sensors (see ENABLE_CRANK_SENSOR etc. in gamecubecontroller.h)
+// PB8 - crank sensor (reed switch to GND)
+// PB9 - heart rate receiver pulse output
+// PB0 - resistance knob potentiometer wiper (ends to GND and 3.3V)
+
 // Connections for Nunchuck
 // GND--GND
 // 3.3V--3.3V
@@ -47,13 +52,20 @@
 #include <stdlib.h>
 #include <libmaple/iwdg.h>
 #include "debounce.h"
+#include "dwt.h"
 #include "gamecubecontroller.h"
 
 NunchuckController nunchuck;
 GameCubeController gc(gcPinID);
 Debounce debounceDown(downButton, HIGH);
 Debounce debounceUp(upButton, HIGH);
+#ifdef POLL_IN_INTERRUPT
+HardwareTimer pollTimer(4); // timer 2 drives the indicator LED PWM
+#endif
 unsigned numDisplayableModes = 0;
+uint8_t displayedModeNumber[numInjectionModes];
+uint8_t nextShownMode[numInjectionModes];
+uint8_t prevShownMode[numInjectionModes];
 uint8 leftMotor = 0;
 uint8 rightMotor = 0; 
 uint32 lastRumbleOff = 0;
@@ -66,18 +78,37 @@ void displayNumber(uint8_t x) {
 
 void updateDisplay() {
   if (injectors[injectionMode].show) {
-    unsigned count = 0;
-    for (unsigned i = 0 ; i < injectionMode ; i++) {
-      if (injectors[i].show)
-        count++;
-    }
-    displayNumber(numDisplayableModes >= 16 ? count : count+1);    
+    displayNumber(displayedModeNumber[injectionMode]);    
   }
   else {
     displayNumber(0);
   }
 }
 
+// precompute LED numbers and up/down neighbors so that mode switching doesn't scan injectors[]
+void indexModes() {
+  numDisplayableModes = 0;
+  for (unsigned i=0; i<numInjectionModes; i++)
+    if (injectors[i].show)
+      displayedModeNumber[i] = numDisplayableModes++;
+  if (numDisplayableModes < 16)
+    for (unsigned i=0; i<numInjectionModes; i++)
+      displayedModeNumber[i]++;
+
+  for (unsigned i=0; i<numInjectionModes; i++) {
+    unsigned j = i;
+    do {
+      j = (j + 1) % numInjectionModes;
+    } while (j != i && ! injectors[j].show);
+    nextShownMode[i] = j;
+    j = i;
+    do {
+      j = (j + numInjectionModes - 1) % numInjectionModes;
+    } while (j != i && ! injectors[j].show);
+    prevShownMode[i] = j;
+  }
+}
+
 const uint8_t reportDescription[] = {
    HID_MOUSE_REPORT_DESCRIPTOR(),
    HID_KEYBOARD_REPORT_DESCRIPTOR(),
@@ -178,10 +209,7 @@ void setup() {
   pinMode(downButton, INPUT_PULLDOWN);
   pinMode(upButton, INPUT_PULLDOWN);
 
-  numDisplayableModes = 0;
-  for (unsigned i=0; i<numInjectionModes; i++)
-    if (injectors[i].show)
-      numDisplayableModes++;
+  indexModes();
   
   DEBUG("gamecube controller adapter");
 
@@ -221,6 +249,18 @@ void setup() {
   
   updateDisplay();
 
+#ifdef POLL_IN_INTERRUPT
+  pollTimer.pause();
+  pollTimer.setPeriod(pollPeriodMicros);
+  pollTimer.setMode(TIMER_CH1, TIMER_OUTPUT_COMPARE);
+  pollTimer.setCompare(TIMER_CH1, 1);
+  pollTimer.attachInterrupt(TIMER_CH1, pollControllers);
+  pollTimer.refresh();
+  pollTimer.resume();
+#endif
+
+  DWTInitTimer();
+
   lastChangedModeTime = 0;
   iwdg_init(IWDG_PRE_256, watchdogSeconds*156);
 }
@@ -255,83 +295,83 @@ static uint16_t deadzone(uint16_t x) {
     return x;
 }
 
-static uint8_t receiveReport(GameControllerData_t* data, uint8_t deviceNumber) {
-  uint8_t success;
-  uint8_t reservedDevice = deviceNumber > 0 ? validDevices[0] : CONTROLLER_NONE;
-  uint8_t validDevice = validDevices[deviceNumber];
+// Reads the GameCube controller; run from the poll timer interrupt. Returns true if it answered.
+static bool receiveGameCube(GameControllerData_t* data) {
+#ifdef ENABLE_GAMECUBE
   bool rumble;
 
-#ifdef ENABLE_GAMECUBE
-  if (reservedDevice != CONTROLLER_GAMECUBE && ( validDevices[deviceNumber] == CONTROLLER_GAMECUBE || validDevice == CONTROLLER_NONE) ) {
-    DEBUG("Trying gamecube");
-    
-    rumble = injectors[injectionMode].rumble && (leftMotor || rightMotor);
-    
-    if (! rumble) {
-      lastRumbleOff = millis();
-    }
+  DEBUG("Trying gamecube");
+  
+  rumble = injectors[injectionMode].rumble && (leftMotor || rightMotor);
+  
+  if (! rumble) {
+    lastRumbleOff = millis();
+  }
+  else {
+    uint32_t delta = millis() - lastRumbleOff;
+    if (delta >= MAX_RUMBLE_TIME)
+      rumble = false;
     else {
-      uint32_t delta = millis() - lastRumbleOff;
-      if (delta >= MAX_RUMBLE_TIME)
-        rumble = false;
-      else {
-        // do a poor man's PWM to adjust rumble speed
-        uint32_t dutyCycle = 35 + ((uint32_t)leftMotor+2*(uint32_t)rightMotor)*65/(255*3);
-        rumble = (delta % 100) <= dutyCycle;
-      }
+      // do a poor man's PWM to adjust rumble speed
+      uint32_t dutyCycle = 35 + ((uint32_t)leftMotor+2*(uint32_t)rightMotor)*65/(255*3);
+      rumble = (delta % 100) <= dutyCycle;
     }
+  }
 
-    gc.setDPadToJoystick(injectors[injectionMode].dpadToJoystick);
-    success = gc.readWithRumble(data, rumble);
-    if (success) {
+  gc.setDPadToJoystick(injectors[injectionMode].dpadToJoystick);
+  if (gc.readWithRumble(data, rumble)) {
 #if DEADZONE_10BIT > 0
-      data->joystickX = deadzone(data->joystickX);
-      data->joystickY = deadzone(data->joystickY);
-      data->cX = deadzone(data->cX);
-      data->cY = deadzone(data->cY);
-#endif      
-      DEBUG("Success");
-      validDevices[deviceNumber] = CONTROLLER_GAMECUBE;
-#ifdef ENABLE_AUTO_CALIBRATE            
-      static int16_t calStick1X = 0;
-      static int16_t calStick1Y = 0;
-      static int16_t calStick2X = 0;
-      static int16_t calStick2Y = 0;
-      if (needToCalibrate) {
-        calStick1X = data->joystickX-512;
-        calStick1Y = data->joystickY-512;
-        calStick2X = data->cX-512;
-        calStick2Y = data->cY-512;
-        needToCalibrate = false;
-      }
-      else {
-        data->joystickX = calibrate(data->joystickX, calStick1X);
-        data->joystickY = calibrate(data->joystickY, calStick1Y);
-        data->cX = calibrate(data->cX, calStick2X);
-        data->cY = calibrate(data->cY, calStick2Y);
-      }
-#endif      
-      return 1;
-    } 
-    validDevice = CONTROLLER_NONE;
-  }
+    data->joystickX = deadzone(data->joystickX);
+    data->joystickY = deadzone(data->joystickY);
+    data->cX = deadzone(data->cX);
+    data->cY = deadzone(data->cY);
+#endif
+    DEBUG("Success");
+#ifdef ENABLE_AUTO_CALIBRATE
+    static int16_t calStick1X = 0;
+    static int16_t calStick1Y = 0;
+    static int16_t calStick2X = 0;
+    static int16_t calStick2Y = 0;
+    if (needToCalibrate) {
+      calStick1X = data->joystickX-512;
+      calStick1Y = data->joystickY-512;
+      calStick2X = data->cX-512;
+      calStick2Y = data->cY-512;
+      needToCalibrate = false;
+    }
+    else {
+      data->joystickX = calibrate(data->joystickX, calStick1X);
+      data->joystickY = calibrate(data->joystickY, calStick1Y);
+      data->cX = calibrate(data->cX, calStick2X);
+      data->cY = calibrate(data->cY, calStick2Y);
+    }
 #endif
+    return true;
+  } 
+#endif
+  return false;
+}
+
 #ifdef ENABLE_NUNCHUCK
-  if (reservedDevice != CONTROLLER_NUNCHUCK && ( validDevice == CONTROLLER_NUNCHUCK || nunchuck.begin())) {
-    success = nunchuck.read(data);
+// Reads the nunchuck; run from loop(), since its I2C library relies on interrupts and millis()
+// timeouts, which can't run inside the poll timer interrupt. Returns true if it answered.
+static bool receiveNunchuck(GameControllerData_t* data) {
+  static bool found = false;
+  if (! found && ! nunchuck.begin())
+    return false;
+  found = nunchuck.read(data);
 #ifdef SERIAL_DEBUG
-    CompositeSerial.println(success);
+  CompositeSerial.println(found);
 #endif            
-    if (success) {
-      data->joystickX = deadzone(data->joystickX);
-      data->joystickY = deadzone(data->joystickY);
-      validDevices[deviceNumber] = CONTROLLER_NUNCHUCK;
-      return 1;
-    }
+  if (found) {
+    data->joystickX = deadzone(data->joystickX);
+    data->joystickY = deadzone(data->joystickY);
   }
+  return found;
+}
 #endif
-  validDevices[deviceNumber] = CONTROLLER_NONE;
 
+static void noController(GameControllerData_t* data) {
   data->joystickX = 512;
   data->joystickY = 512;
   data->cX = 512;
@@ -340,8 +380,146 @@ static uint8_t receiveReport(GameControllerData_t* data, uint8_t deviceNumber) {
   data->shoulderLeft = 0;
   data->shoulderRight = 0;
   data->device = CONTROLLER_NONE;
+}
+
+bool pollDual = false;
+volatile uint32_t maxPollJitterMicros = 0;
+uint32_t maxSampleAgeMicros = 0; // longest time from reading a controller to injecting what was read
+volatile uint32_t sampleSequence = 0;
+ControllerSample_t gameCubeSample;
+uint32_t lastInputChangeTime = 0;
+uint32_t maxSaveStallCycles = 0;
+#ifdef BENCHMARK_INJECT
+uint32_t idleInjectCycles = 0;
+uint32_t idleInjectCount = 0;
+uint32_t activeInjectCycles = 0;
+uint32_t activeInjectCount = 0;
+#endif
+
+// A compiler barrier would do between an interrupt and loop(), but a full barrier is only a DMB
+// on the Cortex-M3 and also keeps the host stress test in test/ valid on any CPU.
+#define MEMORY_BARRIER() __sync_synchronize()
+
+// Producer side of the GameCube controller sample pipeline, run from the poll timer interrupt.
+// gameCubeSample is protected by a sequence lock: sampleSequence is odd while it is being
+// written. The producer never waits for loop(), so slow work there (flash writes, mode switches,
+// feature requests, the nunchuck) doesn't delay the next controller poll.
+void pollControllers() {
+  static uint32_t lastPollMicros = 0;
+  uint32_t t = micros();
+
+  if (! validUSB) {
+    lastPollMicros = 0;
+    return;
+  }
+
+  if (lastPollMicros != 0) {
+    uint32_t spacing = t - lastPollMicros;
+    uint32_t jitter = spacing > pollPeriodMicros ? spacing - pollPeriodMicros : pollPeriodMicros - spacing;
+    if (jitter > maxPollJitterMicros)
+      maxPollJitterMicros = jitter;
+  }
+  lastPollMicros = t;
 
-  return 1;
+  GameControllerData_t data;
+  bool valid = receiveGameCube(&data);
+  uint32_t time = micros();
+
+  sampleSequence++;
+  MEMORY_BARRIER();
+  gameCubeSample.data = data;
+  gameCubeSample.time = time;
+  gameCubeSample.valid = valid;
+  MEMORY_BARRIER();
+  sampleSequence++;
+}
+
+// Consumer side: copies the freshest complete sample, retrying if the producer got in while we
+// were copying. Returns the sequence number of the copy.
+static uint32_t readGameCubeSample(ControllerSample_t* out) {
+  uint32_t s;
+  do {
+    s = sampleSequence;
+    MEMORY_BARRIER();
+    *out = gameCubeSample;
+    MEMORY_BARRIER();
+  } while ((s & 1) || s != sampleSequence);
+  return s;
+}
+
+// Puts together what loop() injects from a new GameCube controller sample and, if there is one,
+// the nunchuck, which is read here. The GameCube controller comes first when it is connected;
+// the nunchuck is then the second controller in the dual modes, and otherwise the only one.
+// In the dual modes, a missing second controller is injected as centered.
+static void assembleSamples(ControllerSample_t* sample, const ControllerSample_t* gameCube, bool dual) {
+  sample[0] = *gameCube;
+  sample[1].valid = false;
+#ifdef ENABLE_NUNCHUCK
+  if (! gameCube->valid || dual) {
+    ControllerSample_t* n = gameCube->valid ? sample + 1 : sample;
+    n->valid = receiveNunchuck(&n->data);
+    n->time = micros();
+  }
+#endif
+  if (! sample[0].valid) {
+    noController(&sample[0].data);
+    sample[0].valid = true;
+  }
+  if (dual && ! sample[1].valid) {
+    noController(&sample[1].data);
+    sample[1].time = sample[0].time;
+    sample[1].valid = true;
+  }
+  validDevices[0] = sample[0].data.device;
+  validDevices[1] = dual ? sample[1].data.device : CONTROLLER_NONE;
+}
+
+// Saves at most one half-word of settings to flash, or erases the settings page if allowed, and
+// keeps track of the longest time this has held up the loop. The stall is measured with the
+// cycle counter, since the SysTick interrupt can't run during a flash erase.
+static void commitSettings(bool allowErase) {
+  uint32_t c0 = DWT->CYCCNT;
+  if (EEPROM8_commitStep(allowErase)) {
+    uint32_t stall = DWT->CYCCNT - c0;
+    if (stall > maxSaveStallCycles)
+      maxSaveStallCycles = stall;
+  }
+}
+
+static inline bool differsBy(int32_t a, int32_t b, int32_t tolerance) {
+  return a - b > tolerance || b - a > tolerance;
+}
+
+// Returns true if the controls are in use: a button is held, or a stick, a shoulder or the
+// exercise machine's speed or cadence has moved by more than idleTolerance since the last time
+// this returned true. Stick noise and readings like the heart rate, which change all the time
+// on their own, don't count, so they can't hold off a settings erase forever.
+static bool controlsActive(const ControllerSample_t* sample, const ExerciseMachineData_t* exerciseMachine) {
+  static GameControllerData_t reference[2];
+  static ExerciseMachineData_t exerciseReference;
+  bool active = false;
+
+  for (int i = 0; i < 2; i++) {
+    if (! sample[i].valid)
+      continue;
+    const GameControllerData_t* d = &sample[i].data;
+    const GameControllerData_t* r = reference + i;
+    if (d->buttons != 0 || d->device != r->device ||
+      differsBy(d->joystickX, r->joystickX, idleTolerance) || differsBy(d->joystickY, r->joystickY, idleTolerance) ||
+      differsBy(d->cX, r->cX, idleTolerance) || differsBy(d->cY, r->cY, idleTolerance) ||
+      differsBy(d->shoulderLeft, r->shoulderLeft, idleTolerance) || differsBy(d->shoulderRight, r->shoulderRight, idleTolerance)) {
+      reference[i] = *d;
+      active = true;
+    }
+  }
+
+  if (differsBy(exerciseMachine->speed, exerciseReference.speed, idleTolerance) ||
+    differsBy(exerciseMachine->cadence, exerciseReference.cadence, idleTolerance)) {
+    exerciseReference = *exerciseMachine;
+    active = true;
+  }
+
+  return active;
 }
 
 void setFeature(const void* s) {
@@ -409,6 +587,34 @@ void pollFeatureRequests() {
         }
       }
     }
+    else if (0==strcmp((char*)featureReport, "jitter?")) {
+      // worst poll spacing error and worst sample age, in microseconds
+      strcpy((char*)featureReport, "jitter=");
+      intToString((char*)featureReport+7, maxPollJitterMicros);
+      strcat((char*)featureReport, ",age=");
+      intToString((char*)featureReport+strlen((char*)featureReport), maxSampleAgeMicros);
+      maxPollJitterMicros = 0;
+      maxSampleAgeMicros = 0;
+      setFeature(featureReport);
+    }
+#ifdef BENCHMARK_INJECT
+    else if (0==strcmp((char*)featureReport, "cycles?")) {
+      // average cycles per inject() call that skipped the report, then per call that built one
+      strcpy((char*)featureReport, "cycles=");
+      intToString((char*)featureReport+7, idleInjectCount ? idleInjectCycles / idleInjectCount : 0);
+      strcat((char*)featureReport, ",");
+      intToString((char*)featureReport+strlen((char*)featureReport), activeInjectCount ? activeInjectCycles / activeInjectCount : 0);
+      idleInjectCycles = idleInjectCount = activeInjectCycles = activeInjectCount = 0;
+      setFeature(featureReport);
+    }
+#endif
+    else if (0==strcmp((char*)featureReport, "stall?")) {
+      // longest time in microseconds that saving settings has held up the loop
+      strcpy((char*)featureReport, "stall=");
+      intToString((char*)featureReport+6, maxSaveStallCycles / (SystemCoreClock / 1000000ul));
+      maxSaveStallCycles = 0;
+      setFeature(featureReport);
+    }
     else if (0==strcmp((char*)featureReport, "modes?")) {
       strcpy((char*)featureReport, "modes=");
       intToString((char*)featureReport+6, numInjectionModes);
@@ -430,12 +636,7 @@ void pollFeatureRequests() {
 }
 
 void adjustMode(int delta) {
-  do {
-    if (delta < 0 && injectionMode == 0)
-      injectionMode = numInjectionModes;
-    injectionMode += delta;
-    injectionMode %= numInjectionModes; 
-  } while (! injectors[injectionMode].show);
+  injectionMode = delta < 0 ? prevShownMode[injectionMode] : nextShownMode[injectionMode];
   lastChangedModeTime = millis();
   leftMotor = 0;
   rightMotor = 0;
@@ -445,10 +646,9 @@ void adjustMode(int delta) {
 uint32_t prevT = 0;
 
 void loop() {
-  GameControllerData_t data;
-  GameControllerData_t data2;
-  ExerciseMachineData_t exerciseMachine;
-  bool dual = false;
+  static uint32_t lastSequence = 0;
+  ControllerSample_t sample[2];
+  static ExerciseMachineData_t exerciseMachine;
 
   uint32_t t0 = millis();
   while (debounceDown.getRawState() && debounceUp.getRawState() && (millis()-t0)<5000)
@@ -494,6 +694,7 @@ void loop() {
   if (!USBComposite.isReady()) {
     // we're disconnected; save power by not talking to controller
     validUSB = 0;
+    commitSettings(true);
     updateLED();
     return;
   } // TODO: fix library so it doesn't send on a disconnected connection; currently, we're relying on the watchdog reset 
@@ -505,26 +706,59 @@ void loop() {
   validUSB = 1;
 #endif
 
-  dual = (currentUSBMode == &modeDualJoystick && injectors[injectionMode].usbMode == &modeDualJoystick) ||
+  pollDual = (currentUSBMode == &modeDualJoystick && injectors[injectionMode].usbMode == &modeDualJoystick) ||
          (currentUSBMode == &modeDualX360 && injectors[injectionMode].usbMode == &modeDualX360);
+#ifndef POLL_IN_INTERRUPT
   uint32_t t1 = millis();
   uint32_t d = t1-prevT;
   if (d < 5)
     delay(5-d);
   prevT = t1;
-  receiveReport(&data,0);
-  if (dual)
-    dual = (bool)receiveReport(&data2,1);
-  DEBUG("joystick = "+String(data.joystickX)+","+String(data.joystickY));  
+  pollControllers();
+#endif
+
+  ControllerSample_t gameCube;
+  uint32_t sequence = readGameCubeSample(&gameCube);
+  if (sequence == lastSequence) {
+    // nothing new from the controllers yet
+    updateLED();
+    return;
+  }
+  lastSequence = sequence;
+  // with a new poll period started, it's also time for the nunchuck
+  assembleSamples(sample, &gameCube, pollDual);
+  uint32_t age = micros() - sample[0].time;
+  if (age > maxSampleAgeMicros)
+    maxSampleAgeMicros = age;
+  DEBUG("joystick = "+String(sample[0].data.joystickX)+","+String(sample[0].data.joystickY));  
 
   if (USBComposite.isReady()) {
-    inject(&Joystick, x360_1, injectors + injectionMode, &data, &exerciseMachine);
+#ifdef BENCHMARK_INJECT
+    uint32_t c0 = DWT->CYCCNT;
+    if (inject(&Joystick, x360_1, injectors + injectionMode, &sample[0].data, &exerciseMachine)) {
+      activeInjectCycles += DWT->CYCCNT - c0;
+      activeInjectCount++;
+    }
+    else {
+      idleInjectCycles += DWT->CYCCNT - c0;
+      idleInjectCount++;
+    }
+#else
+    inject(&Joystick, x360_1, injectors + injectionMode, &sample[0].data, &exerciseMachine);
+#endif
 
-    if (dual) {
-       inject(&Joystick2, x360_2, injectors + injectionMode, &data2, &exerciseMachine);
+    if (sample[1].valid) {
+       inject(&Joystick2, x360_2, injectors + injectionMode, &sample[1].data, &exerciseMachine);
     } 
   }
+
+  if (controlsActive(sample, &exerciseMachine))
+    lastInputChangeTime = millis();
+
+  // A report has just gone out and the next sample is a poll period away, so this is when a
+  // flash write gets in the way least.
+  commitSettings(millis() - lastInputChangeTime >= eraseSettingsAfterIdleMillis);
     
   updateLED();
 }
-
+
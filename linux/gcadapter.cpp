@@ -0,0 +1,490 @@
+// Linux configuration and monitoring tool for the adapter; replaces mode.py/rumble.py on Linux.
+//
+// Talks to the firmware's feature report handler (see pollFeatureRequests()) through /dev/hidraw,
+// and to the emulated XBox360 controller through evdev force feedback. All waiting is done with
+// poll() and timerfds rather than busy loops, and every command runs on all attached adapters
+// at once unless -d is given.
+//
+// Usage:
+//   gcadapter [-d /dev/hidrawN] list                  id and current mode of each adapter
+//   gcadapter [-d /dev/hidrawN] modes                 list the modes of each adapter
+//   gcadapter [-d /dev/hidrawN] mode <commandName>    switch mode
+//   gcadapter [-d /dev/hidrawN] monitor [ms] [query]  repeat query (default "m") every ms (default 1000)
+//   gcadapter exit360                                 send Exit2HID to emulated XBox360 controllers
+//
+// You will need read/write access to the hidraw and event devices, e.g., via a udev rule.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+
+#include <string>
+#include <vector>
+
+static const uint16_t vendorId = 0x1EAF;
+static const uint16_t productIdSingle = 0xe167;
+static const uint16_t productIdDual = 0xe170;
+static const uint16_t switchVendorId = 0x0F0D;
+static const uint16_t switchProductId = 0x00c1;
+static const uint16_t x360VendorId = 0x045e;
+static const uint16_t x360ProductId = 0x028e;
+
+static const uint8_t joystickReportId = 20; // HID_JOYSTICK_REPORT_ID
+static const size_t featureDataSize = 63;   // FEATURE_DATA_SIZE
+
+static const uint64_t queryTimeoutMillis = 1000;
+static const uint64_t firstRetryMillis = 2;
+static const uint64_t maxRetryMillis = 16;
+static const uint64_t maxConfirmRetryMillis = 128; // loop() can be held up by a flash erase or a delay()
+
+static const char xMessage[] = "Exit2HID";
+static const int xMessageDelayMillis = 10;
+
+struct Adapter {
+  std::string path;
+  int fd;
+  uint8_t reportId;
+
+  // current exchange
+  std::string command;
+  std::string confirm; // query that shows whether command took effect; empty if command is itself a query
+  std::string expect; // prefix of the answer, or with confirm, the whole answer; empty if no answer is expected
+  std::string answer;
+  bool confirming; // confirm was sent after the last copy of command
+  bool done;
+  bool ok;
+  uint64_t started;
+  uint64_t nextPoll;
+  uint64_t retryDelay;
+};
+
+static uint64_t nowMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sleepMillis(int ms) {
+  poll(NULL, 0, ms);
+}
+
+static bool setFeature(Adapter& a, const std::string& s) {
+  uint8_t buf[1 + featureDataSize] = { 0 };
+  buf[0] = a.reportId;
+  strncpy((char*)buf + 1, s.c_str(), featureDataSize - 1);
+  return ioctl(a.fd, HIDIOCSFEATURE(sizeof(buf)), buf) >= 0;
+}
+
+static bool getFeature(Adapter& a, std::string& out) {
+  uint8_t buf[1 + featureDataSize + 1] = { 0 };
+  buf[0] = a.reportId;
+  int n = ioctl(a.fd, HIDIOCGFEATURE(1 + featureDataSize), buf);
+  if (n < 1)
+    return false;
+  out = std::string((char*)buf + 1, strnlen((char*)buf + 1, n - 1));
+  return true;
+}
+
+static std::vector<Adapter> findAdapters(const char* only) {
+  std::vector<Adapter> adapters;
+  glob_t g;
+
+  if (glob(only != NULL ? only : "/dev/hidraw*", 0, NULL, &g) != 0)
+    return adapters;
+
+  for (size_t i = 0; i < g.gl_pathc; i++) {
+    int fd = open(g.gl_pathv[i], O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    struct hidraw_devinfo info;
+    if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0) {
+      close(fd);
+      continue;
+    }
+    uint16_t vendor = (uint16_t)info.vendor;
+    uint16_t product = (uint16_t)info.product;
+    Adapter a = Adapter();
+    a.path = g.gl_pathv[i];
+    a.fd = fd;
+    if (vendor == vendorId && (product == productIdSingle || product == productIdDual)) {
+      a.reportId = joystickReportId;
+      adapters.push_back(a);
+    }
+    else if (vendor == switchVendorId && product == switchProductId) {
+      a.reportId = 0;
+      adapters.push_back(a);
+    }
+    else {
+      close(fd);
+    }
+  }
+  globfree(&g);
+  return adapters;
+}
+
+static void armTimer(int tfd, uint64_t whenMillis) {
+  struct itimerspec its = {};
+  its.it_value.tv_sec = whenMillis / 1000;
+  its.it_value.tv_nsec = (whenMillis % 1000) * 1000000;
+  if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+    its.it_value.tv_nsec = 1; // zero would disarm
+  timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Sends each adapter its command and waits for all of the answers concurrently. The firmware
+// answers from loop(), so we read the feature report back after a short delay, backing off
+// exponentially and resending the command in case the device missed it.
+//
+// The firmware has a single feature buffer, so anything we send before loop() has read the
+// previous command replaces it. A command that doesn't answer, like m:, is therefore checked
+// with a separate confirm query, sent a retry delay after the command, and both are sent again
+// until the confirm query gives the expected answer.
+static void exchange(std::vector<Adapter>& adapters) {
+  uint64_t t = nowMillis();
+  for (Adapter& a : adapters) {
+    a.answer.clear();
+    a.ok = setFeature(a, a.command);
+    a.done = !a.ok || a.expect.empty();
+    a.confirming = false;
+    a.started = t;
+    a.retryDelay = firstRetryMillis;
+    a.nextPoll = t + a.retryDelay;
+  }
+
+  int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (tfd < 0) {
+    perror("timerfd_create");
+    return;
+  }
+
+  for (;;) {
+    uint64_t next = UINT64_MAX;
+    std::vector<struct pollfd> fds;
+    std::vector<Adapter*> polled;
+
+    fds.push_back({ tfd, POLLIN, 0 });
+    for (Adapter& a : adapters) {
+      if (a.done)
+        continue;
+      if (a.nextPoll < next)
+        next = a.nextPoll;
+      fds.push_back({ a.fd, POLLIN, 0 });
+      polled.push_back(&a);
+    }
+    if (polled.empty())
+      break;
+    armTimer(tfd, next);
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    for (size_t i = 0; i < polled.size(); i++) {
+      short revents = fds[i + 1].revents;
+      if (revents & (POLLHUP | POLLERR | POLLNVAL)) {
+        polled[i]->done = true;
+        polled[i]->ok = false;
+      }
+      else if (revents & POLLIN) {
+        // discard input reports so they don't pile up in the kernel
+        uint8_t buf[64];
+        while (read(polled[i]->fd, buf, sizeof(buf)) > 0) ;
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      uint64_t expirations;
+      if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        break;
+    }
+
+    t = nowMillis();
+    for (Adapter* a : polled) {
+      if (a->done || t < a->nextPoll)
+        continue;
+      if (!a->confirm.empty() && !a->confirming) {
+        setFeature(*a, a->confirm);
+        a->confirming = true;
+        a->nextPoll = t + a->retryDelay;
+        continue;
+      }
+      std::string s;
+      bool answered = getFeature(*a, s);
+      if (answered && a->confirm.empty() && s.compare(0, a->expect.size(), a->expect) == 0) {
+        a->answer = s.substr(a->expect.size());
+        a->done = true;
+      }
+      else if (answered && !a->confirm.empty() && s == a->expect) {
+        a->answer = s;
+        a->done = true;
+      }
+      else if (t - a->started >= queryTimeoutMillis) {
+        if (answered && !a->confirm.empty())
+          a->answer = s; // the last answer, for the error message
+        a->done = true;
+        a->ok = false;
+      }
+      else {
+        setFeature(*a, a->command);
+        a->confirming = false;
+        uint64_t maxDelay = a->confirm.empty() ? maxRetryMillis : maxConfirmRetryMillis;
+        a->retryDelay = a->retryDelay * 2 > maxDelay ? maxDelay : a->retryDelay * 2;
+        a->nextPoll = t + a->retryDelay;
+      }
+    }
+  }
+
+  close(tfd);
+}
+
+static void queryAll(std::vector<Adapter>& adapters, const std::string& name) {
+  for (Adapter& a : adapters) {
+    a.command = name + "?";
+    a.confirm.clear();
+    a.expect = name + "=";
+  }
+  exchange(adapters);
+}
+
+// Sends command until querying name gives name=value.
+static void commandAll(std::vector<Adapter>& adapters, const std::string& command, const std::string& name, const std::string& value) {
+  for (Adapter& a : adapters) {
+    a.command = command;
+    a.confirm = name + "?";
+    a.expect = name + "=" + value;
+  }
+  exchange(adapters);
+}
+
+static const char* answerOf(const Adapter& a) {
+  return a.ok ? a.answer.c_str() : "(no answer)";
+}
+
+static int list(std::vector<Adapter>& adapters) {
+  queryAll(adapters, "id");
+  std::vector<std::string> ids;
+  for (Adapter& a : adapters)
+    ids.push_back(answerOf(a));
+  queryAll(adapters, "M");
+  for (size_t i = 0; i < adapters.size(); i++)
+    printf("%s: %s: %s\n", adapters[i].path.c_str(), ids[i].c_str(), answerOf(adapters[i]));
+  return 0;
+}
+
+static int modes(std::vector<Adapter>& adapters) {
+  queryAll(adapters, "modes");
+  unsigned maxModes = 0;
+  std::vector<unsigned> counts;
+  for (Adapter& a : adapters) {
+    unsigned n = a.ok ? (unsigned)atoi(a.answer.c_str()) : 0;
+    counts.push_back(n);
+    if (n > maxModes)
+      maxModes = n;
+  }
+
+  std::vector<std::vector<std::string> > names(adapters.size());
+  for (unsigned m = 0; m < maxModes; m++) {
+    queryAll(adapters, "m" + std::to_string(m));
+    for (size_t i = 0; i < adapters.size(); i++)
+      names[i].push_back(answerOf(adapters[i]));
+    queryAll(adapters, "M" + std::to_string(m));
+    for (size_t i = 0; i < adapters.size(); i++)
+      names[i].back() += std::string("\t") + answerOf(adapters[i]);
+  }
+
+  for (size_t i = 0; i < adapters.size(); i++) {
+    printf("%s:\n", adapters[i].path.c_str());
+    for (unsigned m = 0; m < counts[i]; m++)
+      printf("  %u\t%s\n", m, names[i][m].c_str());
+  }
+  return 0;
+}
+
+static int setMode(std::vector<Adapter>& adapters, const char* name) {
+  commandAll(adapters, std::string("m:") + name, "m", name);
+  int status = 0;
+  for (Adapter& a : adapters) {
+    if (a.ok) {
+      printf("%s: mode set to %s\n", a.path.c_str(), name);
+    }
+    else {
+      printf("%s: error setting mode (last answer: %s)\n", a.path.c_str(), a.answer.empty() ? "none" : a.answer.c_str());
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// Queries at a steady rate: ticks are scheduled from the start time, so slow answers don't
+// make the sampling drift.
+static int monitor(std::vector<Adapter>& adapters, unsigned intervalMillis, const std::string& name) {
+  int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (tfd < 0) {
+    perror("timerfd_create");
+    return 1;
+  }
+  uint64_t start = nowMillis();
+  for (uint64_t tick = 0; ; tick++) {
+    armTimer(tfd, start + tick * intervalMillis);
+    uint64_t expirations;
+    if (read(tfd, &expirations, sizeof(expirations)) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    queryAll(adapters, name);
+    uint64_t t = nowMillis() - start;
+    for (Adapter& a : adapters)
+      printf("%llu.%03llu\t%s\t%s\n", (unsigned long long)(t / 1000), (unsigned long long)(t % 1000), a.path.c_str(), answerOf(a));
+    fflush(stdout);
+  }
+  close(tfd);
+  return 1;
+}
+
+static bool hasRumble(int fd) {
+  uint8_t ffBits[FF_MAX / 8 + 1] = { 0 };
+  if (ioctl(fd, EVIOCGBIT(EV_FF, sizeof(ffBits)), ffBits) < 0)
+    return false;
+  return 0 != (ffBits[FF_RUMBLE / 8] & (1 << (FF_RUMBLE % 8)));
+}
+
+static bool playRumble(int fd, struct ff_effect* effect, uint8_t left, uint8_t right) {
+  effect->u.rumble.strong_magnitude = (uint16_t)left << 8;
+  effect->u.rumble.weak_magnitude = (uint16_t)right << 8;
+  if (ioctl(fd, EVIOCSFF, effect) < 0)
+    return false;
+  struct input_event play = {};
+  play.type = EV_FF;
+  play.code = effect->id;
+  play.value = 1;
+  return write(fd, &play, sizeof(play)) == (ssize_t)sizeof(play);
+}
+
+// The firmware leaves XBox360 mode when it sees the rumble sequence detectModeSwitch() looks
+// for: each character on the left motor, and the character xor 0x4B on the right.
+static int exitX360() {
+  glob_t g;
+  int found = 0;
+
+  if (glob("/dev/input/event*", 0, NULL, &g) != 0) {
+    fprintf(stderr, "No input devices found.\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < g.gl_pathc; i++) {
+    int fd = open(g.gl_pathv[i], O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    struct input_id id;
+    if (ioctl(fd, EVIOCGID, &id) < 0 || id.vendor != x360VendorId || id.product != x360ProductId || !hasRumble(fd)) {
+      close(fd);
+      continue;
+    }
+
+    struct ff_effect effect = {};
+    effect.type = FF_RUMBLE;
+    effect.id = -1;
+    effect.replay.length = 1000;
+    bool ok = true;
+    for (const char* p = xMessage; *p && ok; p++) {
+      ok = playRumble(fd, &effect, (uint8_t)*p, (uint8_t)*p ^ 0x4B);
+      sleepMillis(xMessageDelayMillis);
+    }
+    if (ok) {
+      playRumble(fd, &effect, 0, 0);
+      sleepMillis(xMessageDelayMillis);
+    }
+    if (effect.id >= 0)
+      ioctl(fd, EVIOCRMFF, effect.id);
+    close(fd);
+
+    printf("%s: %s\n", g.gl_pathv[i], ok ? "sent Exit2HID" : strerror(errno));
+    found++;
+  }
+  globfree(&g);
+
+  if (!found) {
+    fprintf(stderr, "No emulated XBox360 controllers with rumble found.\n");
+    return 1;
+  }
+  return 0;
+}
+
+static void usage() {
+  fprintf(stderr,
+    "usage: gcadapter [-d /dev/hidrawN] list\n"
+    "       gcadapter [-d /dev/hidrawN] modes\n"
+    "       gcadapter [-d /dev/hidrawN] mode commandName\n"
+    "       gcadapter [-d /dev/hidrawN] monitor [ms [query]]\n"
+    "       gcadapter exit360\n");
+}
+
+int main(int argc, char** argv) {
+  const char* only = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:h")) != -1) {
+    if (opt == 'd') {
+      only = optarg;
+    }
+    else {
+      usage();
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+
+  if (optind >= argc) {
+    usage();
+    return 2;
+  }
+
+  std::string command = argv[optind];
+
+  if (command == "exit360")
+    return exitX360();
+
+  std::vector<Adapter> adapters = findAdapters(only);
+  if (adapters.empty()) {
+    fprintf(stderr, "No adapters found. If it is in XBox360 mode, try: gcadapter exit360\n");
+    return 1;
+  }
+
+  int status;
+  if (command == "list") {
+    status = list(adapters);
+  }
+  else if (command == "modes") {
+    status = modes(adapters);
+  }
+  else if (command == "mode" && optind + 1 < argc) {
+    status = setMode(adapters, argv[optind + 1]);
+  }
+  else if (command == "monitor") {
+    unsigned interval = optind + 1 < argc ? (unsigned)atoi(argv[optind + 1]) : 1000;
+    std::string query = optind + 2 < argc ? argv[optind + 2] : "m";
+    status = monitor(adapters, interval > 0 ? interval : 1000, query);
+  }
+  else {
+    usage();
+    status = 2;
+  }
+
+  for (Adapter& a : adapters)
+    close(a.fd);
+  return status;
+}
@@ -0,0 +1,232 @@
+// Runs gcadapter against an emulated adapter: a uhid device whose feature reports are answered by
+// the firmware's own pollFeatureRequests(), compiled for the host with the stand-ins in ../test.
+// A thread plays loop(), calling pollFeatureRequests() every 5 ms, and when an m: command comes
+// in it first stalls for 100 ms, as a USB mode switch or a flash erase would.
+//
+// Needs read/write access to /dev/uhid (usually root); without it, the test is skipped and exits
+// with status 77, which `make check` reports as a failure rather than a pass.
+
+#include "../test/test.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/hidraw.h>
+#include <linux/uhid.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// the exit status for a run that couldn't test anything, as automake test harnesses expect
+static const int SKIPPED = 77;
+
+static const char deviceName[] = "gcadapter test adapter";
+
+// a joystick with one byte of buttons, plus the 63-byte feature report, all with report ID 20
+static const uint8_t reportDescriptor[] = {
+  0x05, 0x01,                   // Usage Page (Generic Desktop)
+  0x09, 0x04,                   // Usage (Joystick)
+  0xA1, 0x01,                   // Collection (Application)
+  0x85, HID_JOYSTICK_REPORT_ID, //   Report ID
+  0x05, 0x09,                   //   Usage Page (Button)
+  0x19, 0x01, 0x29, 0x08,       //   Usage Minimum (1), Usage Maximum (8)
+  0x15, 0x00, 0x25, 0x01,       //   Logical Minimum (0), Logical Maximum (1)
+  0x75, 0x01, 0x95, 0x08,       //   Report Size (1), Report Count (8)
+  0x81, 0x02,                   //   Input (Data, Variable, Absolute)
+  0x06, 0x00, 0xFF,             //   Usage Page (Vendor Defined)
+  0x09, 0x01,                   //   Usage (1)
+  0x15, 0x00, 0x26, 0xFF, 0x00, //   Logical Minimum (0), Logical Maximum (255)
+  0x75, 0x08, 0x95, FEATURE_DATA_SIZE, // Report Size (8), Report Count
+  0xB1, 0x02,                   //   Feature (Data, Variable, Absolute)
+  0xC0                          // End Collection
+};
+
+static std::mutex firmwareLock; // held while the firmware or the uhid thread touches Joystick's feature buffer
+static std::atomic<bool> running(true);
+static std::atomic<unsigned> stalls(0);
+
+static bool writeEvent(int fd, const struct uhid_event& ev) {
+  return write(fd, &ev, sizeof(ev)) == (ssize_t)sizeof(ev);
+}
+
+static void uhidThread(int fd) {
+  while (running) {
+    struct pollfd p = { fd, POLLIN, 0 };
+    if (poll(&p, 1, 50) <= 0)
+      continue;
+    struct uhid_event ev;
+    if (read(fd, &ev, sizeof(ev)) <= 0)
+      continue;
+
+    if (ev.type == UHID_GET_REPORT) {
+      struct uhid_event reply = {};
+      reply.type = UHID_GET_REPORT_REPLY;
+      reply.u.get_report_reply.id = ev.u.get_report.id;
+      reply.u.get_report_reply.err = 0;
+      reply.u.get_report_reply.size = 1 + FEATURE_DATA_SIZE;
+      reply.u.get_report_reply.data[0] = ev.u.get_report.rnum;
+      {
+        std::lock_guard<std::mutex> lock(firmwareLock);
+        memcpy(reply.u.get_report_reply.data + 1, Joystick.feature, FEATURE_DATA_SIZE);
+      }
+      writeEvent(fd, reply);
+    }
+    else if (ev.type == UHID_SET_REPORT) {
+      {
+        std::lock_guard<std::mutex> lock(firmwareLock);
+        memset(Joystick.feature, 0, sizeof(Joystick.feature));
+        if (ev.u.set_report.size > 1)
+          memcpy(Joystick.feature, ev.u.set_report.data + 1, std::min<size_t>(ev.u.set_report.size - 1, FEATURE_DATA_SIZE));
+        Joystick.featureReceived = true;
+      }
+      struct uhid_event reply = {};
+      reply.type = UHID_SET_REPORT_REPLY;
+      reply.u.set_report_reply.id = ev.u.set_report.id;
+      reply.u.set_report_reply.err = 0;
+      writeEvent(fd, reply);
+    }
+  }
+}
+
+static void loopThread(void) {
+  std::string stalledFor;
+  while (running) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    std::string pending;
+    {
+      std::lock_guard<std::mutex> lock(firmwareLock);
+      if (Joystick.featureReceived)
+        pending = (const char*)Joystick.feature;
+    }
+    if (pending.compare(0, 2, "m:") == 0 && pending != stalledFor) {
+      stalledFor = pending;
+      stalls++;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    std::lock_guard<std::mutex> lock(firmwareLock);
+    pollFeatureRequests();
+  }
+}
+
+static std::string findHidraw(void) {
+  for (int attempt = 0; attempt < 100; attempt++) {
+    glob_t g;
+    if (glob("/dev/hidraw*", 0, NULL, &g) == 0) {
+      for (size_t i = 0; i < g.gl_pathc; i++) {
+        int fd = open(g.gl_pathv[i], O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+          continue;
+        char name[256] = "";
+        ioctl(fd, HIDIOCGRAWNAME(sizeof(name)), name);
+        close(fd);
+        if (0 == strcmp(name, deviceName)) {
+          std::string path = g.gl_pathv[i];
+          globfree(&g);
+          return path;
+        }
+      }
+      globfree(&g);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  return "";
+}
+
+// runs a shell command, returning its exit status and putting its output in out
+static int run(const std::string& command, std::string& out) {
+  FILE* f = popen((command + " 2>&1").c_str(), "r");
+  if (f == NULL)
+    return -1;
+  out.clear();
+  char buf[256];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    out.append(buf, n);
+  int status = pclose(f);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static std::string currentMode(void) {
+  std::lock_guard<std::mutex> lock(firmwareLock);
+  return injectors[injectionMode].commandName;
+}
+
+int main() {
+  realClock = true;
+  indexModes();
+
+  int fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    printf("gcadapter: skipped, can't open /dev/uhid: %s\n", strerror(errno));
+    return SKIPPED;
+  }
+
+  struct uhid_event create = {};
+  create.type = UHID_CREATE2;
+  strncpy((char*)create.u.create2.name, deviceName, sizeof(create.u.create2.name) - 1);
+  create.u.create2.rd_size = sizeof(reportDescriptor);
+  memcpy(create.u.create2.rd_data, reportDescriptor, sizeof(reportDescriptor));
+  create.u.create2.bus = BUS_USB;
+  create.u.create2.vendor = VENDOR_ID;
+  create.u.create2.product = PRODUCT_ID_SINGLE;
+  if (!writeEvent(fd, create)) {
+    printf("gcadapter: skipped, can't create a uhid device: %s\n", strerror(errno));
+    close(fd);
+    return SKIPPED;
+  }
+
+  std::thread uhid(uhidThread, fd);
+  std::thread loop(loopThread);
+
+  std::string path = findHidraw();
+  CHECK(!path.empty());
+  if (!path.empty()) {
+    std::string out;
+    std::string device = "./gcadapter -d " + path + " ";
+
+    CHECK_EQUAL(0, run(device + "list", out));
+    CHECK(out.find("GameCubeControllerAdapter") != std::string::npos);
+    CHECK(out.find(injectors[0].description) != std::string::npos);
+
+    CHECK_EQUAL(0, run(device + "modes", out));
+    CHECK(out.find("wasd\tWASD, 4-way") != std::string::npos);
+
+    // each of these stalls the emulated loop() right after the command arrives
+    CHECK_EQUAL(0, run(device + "mode wasd", out));
+    CHECK(out.find("mode set to wasd") != std::string::npos);
+    CHECK(currentMode() == "wasd");
+
+    CHECK_EQUAL(0, run(device + "mode dpadZX", out));
+    CHECK(currentMode() == "dpadZX");
+    CHECK_EQUAL(2, stalls.load());
+
+    // stopped by timeout after about 6 lines of "seconds<tab>path<tab>answer"
+    run("timeout 0.3 " + device + "monitor 50 jitter", out);
+    size_t answers = 0;
+    std::string line = "\t" + path + "\t";
+    for (size_t i = out.find(line); i != std::string::npos; i = out.find(line, i + 1))
+      answers++;
+    CHECK(answers >= 3);
+
+    CHECK_EQUAL(1, run(device + "mode noSuchMode", out));
+    CHECK(out.find("error setting mode (last answer: m=dpadZX)") != std::string::npos);
+    CHECK(currentMode() == "dpadZX");
+  }
+
+  running = false;
+  loop.join();
+  uhid.join();
+
+  struct uhid_event destroy = {};
+  destroy.type = UHID_DESTROY;
+  writeEvent(fd, destroy);
+  close(fd);
+
+  return testResult("gcadapter");
+}
@@ -0,0 +1,84 @@
+#include "gamecubecontroller.h"
+
+// Non-blocking scheduler for MACRO buttons. Up to maxActiveMacros sequences can run at once,
+// and each is advanced from inject(), so a step boundary shows up in the first report built
+// after it is due. Step start times are accumulated from the scheduled times rather than from
+// when the report happened to be built, so errors don't build up over a long sequence.
+
+const unsigned maxActiveMacros = 8;
+const unsigned maxMacroStepsPerUpdate = 4; // bounds the per-loop cost of a macro that fell behind
+
+typedef struct {
+  const MacroStep_t* step; // NULL if slot is free
+  uint32_t stepStart;
+  HIDJoystick* joystick;
+  USBXBox360Controller* x360;
+} ActiveMacro_t;
+
+static ActiveMacro_t activeMacros[maxActiveMacros];
+
+static void macroKey(const MacroStep_t* step, bool press) {
+  if (step->mode != KEY)
+    return;
+  if (press)
+    Keyboard.press(step->value);
+  else
+    Keyboard.release(step->value);
+}
+
+void macroStart(const MacroStep_t* macro, uint32_t t) {
+  if (macro == NULL || macro->duration == 0)
+    return;
+  for (unsigned i = 0; i < maxActiveMacros; i++) {
+    ActiveMacro_t* m = activeMacros + i;
+    if (m->step == NULL) {
+      m->step = macro;
+      m->stepStart = t;
+      m->joystick = curJoystick;
+      m->x360 = curX360;
+      macroKey(macro, true);
+      return;
+    }
+  }
+  // all slots busy: drop this trigger
+}
+
+// adds the current steps' joystick buttons to the report being built by inject()
+void macroUpdate(uint32_t t) {
+  for (unsigned i = 0; i < maxActiveMacros; i++) {
+    ActiveMacro_t* m = activeMacros + i;
+    if (m->step == NULL || m->joystick != curJoystick || m->x360 != curX360)
+      continue;
+    unsigned n = 0;
+    while (t - m->stepStart >= m->step->duration) {
+      macroKey(m->step, false);
+      m->stepStart += m->step->duration;
+      m->step++;
+      if (m->step->duration == 0) {
+        m->step = NULL;
+        break;
+      }
+      macroKey(m->step, true);
+      if (++n >= maxMacroStepsPerUpdate)
+        break;
+    }
+    if (m->step != NULL && m->step->mode == JOY)
+      pressJoystickButton(m->step->value);
+  }
+}
+
+void macroStopAll(void) {
+  for (unsigned i = 0; i < maxActiveMacros; i++) {
+    if (activeMacros[i].step != NULL) {
+      macroKey(activeMacros[i].step, false);
+      activeMacros[i].step = NULL;
+    }
+  }
+}
+
+bool macroActive(void) {
+  for (unsigned i = 0; i < maxActiveMacros; i++)
+    if (activeMacros[i].step != NULL)
+      return true;
+  return false;
+}
@@ -1,10 +1,27 @@
 #include "gamecubecontroller.h"
 
-uint8_t prevButtons[numberOfButtons];
-uint8_t curButtons[numberOfButtons];
-GameControllerData_t oldData;
+InjectedButton_t decodedButtons[numberOfButtons];
+
+// What the last report for each controller was built from, so that inject() only redoes the
+// parts of the report whose inputs have changed, and only sends when something did.
+typedef struct {
+  GameControllerData_t data;
+  ExerciseMachineData_t exerciseMachine;
+  uint8_t prevButtons[numberOfButtons];
+  uint8_t curButtons[numberOfButtons];
+  uint32_t turboStartTime[numberOfButtons];
+  uint64_t reportButtons; // bit b is set if button b is pressed in the report
+  bool pressedSomethingElseWithShift;
+  bool downButton;
+  bool built;
+  bool timed; // a turbo button was held, so the report also depends on the time
+  bool shiftChanged; // a shift tap emits its shifted button for just one report
+  bool directionSwitchUp; // which way JOY_SWITCHABLE buttons were mapped
+} InjectState_t;
+
+InjectState_t injectState[2];
+uint64_t pressedJoystickButtons; // the buttons of the report being built, bit b for button b
 int32 shiftButton = -1;
-bool pressedSomethingElseWithShift;
 const Injector_t* prevInjector = NULL;
 HIDJoystick* curJoystick;
 USBXBox360Controller* curX360;
@@ -17,6 +34,95 @@ static void joySliderRight(uint16_t t) {
   curJoystick->sliderRight((1023 - t) & 1023);
 }
 
+void pressJoystickButton(uint8_t b) {
+  if (b < 64)
+    pressedJoystickButtons |= (uint64_t)1 << b;
+}
+
+// updates only the buttons that differ from the last report
+static void setJoystickButtons(uint64_t buttons, uint64_t prev) {
+  for (uint64_t changed = buttons ^ prev; changed != 0; changed &= changed - 1) {
+    uint8_t b = __builtin_ctzll(changed);
+    bool pressed = (buttons >> b) & 1;
+    if (isModeJoystick())
+      curJoystick->button(b, pressed);
+    else if (isModeX360())
+      curX360->button(b, pressed);
+    else
+      Switch.button(b, pressed);
+  }
+}
+
+static bool sameControllerData(const GameControllerData_t* a, const GameControllerData_t* b) {
+  return a->buttons == b->buttons && a->joystickX == b->joystickX && a->joystickY == b->joystickY &&
+    a->cX == b->cX && a->cY == b->cY && a->shoulderLeft == b->shoulderLeft && a->shoulderRight == b->shoulderRight &&
+    a->device == b->device;
+}
+
+// Compares only the readings that the injector's exercise machine callbacks use, so that, e.g.,
+// a heart rate change doesn't make a speed-only injector send a report.
+static bool sameExerciseMachineData(const Injector_t* injector, const ExerciseMachineData_t* a, const ExerciseMachineData_t* b) {
+  if (injector->exerciseMachine != NULL &&
+    (a->speed != b->speed || a->direction != b->direction || a->valid != b->valid))
+    return false;
+  if (injector->exerciseAxes != NULL) {
+    for (const ExerciseAxis_t* axes = injector->exerciseAxes; axes->channel; axes++) {
+      switch (axes->channel) {
+        case EXERCISE_SPEED:
+          if (a->speed != b->speed || a->direction != b->direction)
+            return false;
+          break;
+        case EXERCISE_CADENCE:
+          if (a->cadence != b->cadence || a->direction != b->direction)
+            return false;
+          break;
+        case EXERCISE_HEART_RATE:
+          if (a->heartRate != b->heartRate)
+            return false;
+          break;
+        default:
+          if (a->resistance != b->resistance)
+            return false;
+          break;
+      }
+    }
+  }
+  return true;
+}
+
+static void sendReport() {
+  if (isModeJoystick()) 
+    curJoystick->send();
+  else if (isModeX360())
+    curX360->send();
+  else 
+    Switch.send();
+}
+
+static void decodeButtons(InjectedButton_t* buttons, const PackedButton_t* packed) {
+  for (; *packed != PACKED_END; packed++) {
+    InjectedButton_t* b = buttons + PACKED_INDEX(*packed);
+    switch (PACKED_KIND(*packed)) {
+      case PACKED_JOY:
+        b->mode = JOY;
+        b->value.button = PACKED_VALUE(*packed);
+        break;
+      case PACKED_KEY:
+        b->mode = KEY;
+        b->value.key = PACKED_VALUE(*packed);
+        break;
+      case PACKED_EXTENDED:
+        *b = extendedButtons[PACKED_VALUE(*packed)];
+        if (b->mode == TURBO && b->value.turbo.halfPeriod == 0)
+          b->value.turbo.halfPeriod = 1; // inject() divides by it
+        break;
+      case PACKED_INCLUDE:
+        decodeButtons(buttons, packedIncludes[PACKED_VALUE(*packed)]);
+        break;
+    }
+  }
+}
+
 static void buttonizeStick4Dir(uint8_t* buttons, uint16_t x, uint16_t y) {
   uint32_t dx = x < 512 ? 512 - x : x - 512;
   uint32_t dy = y < 512 ? 512 - y : y - 512;
@@ -249,6 +355,75 @@ void exerciseMachineSliders(const GameControllerData_t* data, const ExerciseMach
 #endif
 }
 
+static uint32_t isqrt(uint32_t x) {
+  uint32_t r = 0;
+  for (uint32_t bit = 1ul << 30; bit != 0; bit >>= 2) {
+    if (x >= r + bit) {
+      x -= r + bit;
+      r = (r >> 1) + bit;
+    }
+    else {
+      r >>= 1;
+    }
+  }
+  return r;
+}
+
+static int32_t exerciseCurve(int32_t value, int32_t fullScale, uint8_t curve) {
+  if (curve == CURVE_LINEAR)
+    return value;
+  if (value > fullScale)
+    value = fullScale;
+  if (curve == CURVE_SQUARE)
+    return value * value / fullScale;
+  else
+    return isqrt(value * fullScale);
+}
+
+void exerciseMachineAxes(const ExerciseAxis_t* axes, const ExerciseMachineData_t* exerciseMachineP) {
+#ifdef ENABLE_EXERCISE_MACHINE
+  for (; axes->channel; axes++) {
+    int32_t out;
+    switch (axes->channel) {
+      case EXERCISE_SPEED:
+      case EXERCISE_CADENCE: {
+        int32_t v = axes->channel == EXERCISE_SPEED ? exerciseMachineP->speed : exerciseMachineP->cadence;
+        v = exerciseCurve(v, 511, axes->curve) * axes->multiplier / 64;
+        out = exerciseMachineP->direction ? 512 + v : 512 - v;
+        break;
+      }
+      case EXERCISE_HEART_RATE:
+        out = exerciseCurve(exerciseMachineP->heartRate, MAX_HEART_RATE, axes->curve) * 4 * axes->multiplier / 64;
+        break;
+      default:
+        out = exerciseCurve(exerciseMachineP->resistance, 1023, axes->curve) * axes->multiplier / 64;
+        break;
+    }
+    if (out < 0)
+      out = 0;
+    else if (out > 1023)
+      out = 1023;
+
+    if (isModeJoystick()) {
+      switch (axes->axis) {
+        case AXIS_SLIDER_LEFT: joySliderLeft(out); break;
+        case AXIS_SLIDER_RIGHT: joySliderRight(out); break;
+        case AXIS_X_ROTATE: curJoystick->Xrotate(out); break;
+        case AXIS_Y_ROTATE: curJoystick->Yrotate(out); break;
+      }
+    }
+    else if (isModeX360()) {
+      switch (axes->axis) {
+        case AXIS_SLIDER_LEFT: curX360->sliderLeft(out >> 2); break;
+        case AXIS_SLIDER_RIGHT: curX360->sliderRight(out >> 2); break;
+        case AXIS_X_ROTATE: curX360->XRight(range10u16s(out)); break;
+        case AXIS_Y_ROTATE: curX360->YRight(-range10u16s(out)); break;
+      }
+    }
+  }
+#endif
+}
+
 void directionSwitchSlider(const GameControllerData_t* data, const ExerciseMachineData_t* exerciseMachineP, int32_t multiplier) {
   (void)multiplier;
   (void)data;
@@ -285,13 +460,15 @@ void joystickNoShoulder(const GameControllerData_t* data) {
 }
 
 // todo: reset two joystick
-void inject(HIDJoystick* joy, USBXBox360Controller* xbox, const Injector_t* injector, const GameControllerData_t* curDataP, const ExerciseMachineData_t* exerciseMachineP) {
+// Returns true if a report was sent or key or mouse events were generated. The buttons are only
+// worked out again when the controller data changed or they depend on the time, the stick
+// callback only runs when the controller data changed, and the exercise machine callbacks only
+// when their readings changed or the stick callback overwrote their axes. Nothing is sent if
+// none of that changed the report.
+bool inject(HIDJoystick* joy, USBXBox360Controller* xbox, const Injector_t* injector, const GameControllerData_t* curDataP, const ExerciseMachineData_t* exerciseMachineP) {
   curJoystick = joy;
   curX360 = xbox;
-  uint8_t* curReport;
-  static uint8_t prevReport[64]; 
-  uint16_t reportSize;
-  bool force = false;
+  InjectState_t* state = injectState + (joy == &Joystick2);
 
   if (currentUSBMode != injector->usbMode) {
     if (lastChangedModeTime + 1000 <= millis()) {
@@ -302,16 +479,18 @@ void inject(HIDJoystick* joy, USBXBox360Controller* xbox, const Injector_t* inje
       currentUSBMode = injector->usbMode;
       currentUSBMode->begin();
     }
-    return;
+    return false;
   }
 
   if (currentUSBMode == &modeDualJoystick && joy == NULL)
-    return;
+    return false;
 
   if (isModeX360() && xbox == NULL)
-    return;
+    return false;
 
   if (prevInjector != injector) {
+    macroStopAll();
+
     if (currentUSBMode == &modeUSBHID) {
       Keyboard.releaseAll();
       Mouse.release(0xFF);
@@ -326,141 +505,162 @@ void inject(HIDJoystick* joy, USBXBox360Controller* xbox, const Injector_t* inje
 
     prevInjector = injector;
 
+    memset(decodedButtons, 0, sizeof(decodedButtons));
+    decodeButtons(decodedButtons, injector->buttons);
+
     shiftButton = -1;
     for (int i = 0; i < numberOfUnshiftedButtons; i++)
-      if (injector->buttons[i].mode == SHIFT) {
+      if (decodedButtons[i].mode == SHIFT) {
         shiftButton = i;
-        pressedSomethingElseWithShift = false;
+        injectState[0].pressedSomethingElseWithShift = false;
+        injectState[1].pressedSomethingElseWithShift = false;
         break;
       }
 
-    force = true;
+    injectState[0].built = false;
+    injectState[1].built = false;
+    state->reportButtons = 0;
   }
-  else {
-    if (isModeJoystick()) {
-      curReport = curJoystick->getReport();
-      reportSize = curJoystick->getReportSize();
-    }
-    else if (isModeX360()) {
-      curReport = curX360->getReport();
-      reportSize = curX360->getReportSize();
-    }
-    else {
-      curReport = Switch.getReport();
-      reportSize = Switch.getReportSize();
-    }
-    if (reportSize > sizeof(prevReport))
-      reportSize = sizeof(prevReport);
-    memcpy(prevReport, curReport, reportSize);
-  }
-
-  memcpy(prevButtons, curButtons, sizeof(curButtons));
-  memset(curButtons, 0, sizeof(curButtons));  
-  toButtonArray(curButtons, curDataP, injector->directions);
-  if (shiftButton >= 0 && curButtons[shiftButton]) {
-    if (!pressedSomethingElseWithShift) {
-      for(int i=0; i<numberOfUnshiftedButtons; i++) {
-        if (i != shiftButton && curButtons[i]) {
-          pressedSomethingElseWithShift = true;
-          break;
+
+  bool downButton = debounceDown.getRawState();
+  bool dataChanged = ! state->built || ! sameControllerData(curDataP, &state->data);
+  // with the down button held, exerciseMachineSliders() also reads the controller
+  bool exerciseChanged = ! state->built || ! sameExerciseMachineData(injector, exerciseMachineP, &state->exerciseMachine) ||
+    (injector->exerciseMachine != NULL && (downButton != state->downButton || (downButton && dataChanged)));
+  bool send = false;
+  bool events = false;
+
+  // JOY_SWITCHABLE buttons also depend on the direction switch
+#ifdef directionSwitch
+  bool directionSwitchUp = digitalRead(directionSwitch) == DIRECTION_SWITCH_FORWARD;
+#else
+  bool directionSwitchUp = true;
+#endif
+  bool switchChanged = directionSwitchUp != state->directionSwitchUp;
+  state->directionSwitchUp = directionSwitchUp;
+
+  if (dataChanged || switchChanged || state->timed || state->shiftChanged || macroActive()) {
+    uint8_t* prevButtons = state->prevButtons;
+    uint8_t* curButtons = state->curButtons;
+    bool wasPressedSomethingElseWithShift = state->pressedSomethingElseWithShift;
+    state->timed = false;
+
+    memcpy(prevButtons, curButtons, sizeof(state->curButtons));
+    memset(curButtons, 0, sizeof(state->curButtons));
+    toButtonArray(curButtons, curDataP, injector->directions);
+    if (shiftButton >= 0 && curButtons[shiftButton]) {
+      if (!state->pressedSomethingElseWithShift) {
+        for(int i=0; i<numberOfUnshiftedButtons; i++) {
+          if (i != shiftButton && curButtons[i]) {
+            state->pressedSomethingElseWithShift = true;
+            break;
+          }
         }
       }
-    }
-    memcpy(curButtons+numberOfUnshiftedButtons, curButtons, numberOfUnshiftedButtons*sizeof(curButtons[0]));
-    memset(curButtons, 0, numberOfUnshiftedButtons*sizeof(curButtons[0]));
-    curButtons[shiftButton] = 1;
-    curButtons[numberOfUnshiftedButtons + shiftButton] = 0;
-  }
-  else {
-    memset(curButtons+numberOfUnshiftedButtons, 0, numberOfUnshiftedButtons*sizeof(curButtons[0]));
-    if (shiftButton >= 0 && prevButtons[shiftButton] && !pressedSomethingElseWithShift) {
-      curButtons[numberOfUnshiftedButtons+shiftButton] = 1;
-      pressedSomethingElseWithShift = true;
+      memcpy(curButtons+numberOfUnshiftedButtons, curButtons, numberOfUnshiftedButtons*sizeof(curButtons[0]));
+      memset(curButtons, 0, numberOfUnshiftedButtons*sizeof(curButtons[0]));
+      curButtons[shiftButton] = 1;
+      curButtons[numberOfUnshiftedButtons + shiftButton] = 0;
     }
     else {
-      pressedSomethingElseWithShift = false;
+      memset(curButtons+numberOfUnshiftedButtons, 0, numberOfUnshiftedButtons*sizeof(curButtons[0]));
+      if (shiftButton >= 0 && prevButtons[shiftButton] && !state->pressedSomethingElseWithShift) {
+        curButtons[numberOfUnshiftedButtons+shiftButton] = 1;
+        state->pressedSomethingElseWithShift = true;
+      }
+      else {
+        state->pressedSomethingElseWithShift = false;
+      }
     }
-  }
+    state->shiftChanged = wasPressedSomethingElseWithShift != state->pressedSomethingElseWithShift;
 
-  const InjectedButton_t* buttonMap = injector->buttons;
+    const InjectedButton_t* buttonMap = decodedButtons;
 
-  int num = shiftButton < 0 ? numberOfUnshiftedButtons : numberOfButtons;
+    int num = shiftButton < 0 ? numberOfUnshiftedButtons : numberOfButtons;
 
-  if (isModeJoystick()) {
-    curJoystick->buttons(0);
-  }
-  else if (isModeX360()) {
-    curX360->buttons(0);
-  }
-  else {
-    Switch.buttons(0);
-  }
-
-  int8_t directionSwitchUp = -1;
-  
-  for (int i = 0; i < num; i++) {
-    if (buttonMap[i].mode == KEY) {
-      if (curButtons[i] != prevButtons[i]) {
-        if (curButtons[i])
-          Keyboard.press(buttonMap[i].value.key);
-        else
-          Keyboard.release(buttonMap[i].value.key);
-      }
-    }
-    else if (buttonMap[i].mode == JOY || buttonMap[i].mode == JOY_SWITCHABLE) {
-      if (curButtons[i]) {
-        uint8_t b;
-        if (buttonMap[i].mode == JOY) {
-          b = buttonMap[i].value.button;
+    pressedJoystickButtons = 0;
+
+    uint32_t now = millis();
+    
+    for (int i = 0; i < num; i++) {
+      if (buttonMap[i].mode == KEY) {
+        if (curButtons[i] != prevButtons[i]) {
+          if (curButtons[i])
+            Keyboard.press(buttonMap[i].value.key);
+          else
+            Keyboard.release(buttonMap[i].value.key);
+          events = true;
         }
-        else {
-#ifdef directionSwitch
-          if (directionSwitchUp < 0)
-            directionSwitchUp = digitalRead(directionSwitch) == DIRECTION_SWITCH_FORWARD;
-            
-          b = directionSwitchUp ? buttonMap[i].value.joySwitchable.upButton : buttonMap[i].value.joySwitchable.downButton;
-#else
-          b = buttonMap[i].value.joySwitchable.upButton;
-#endif    
+      }
+      else if (buttonMap[i].mode == JOY || buttonMap[i].mode == JOY_SWITCHABLE) {
+        if (curButtons[i]) {
+          uint8_t b;
+          if (buttonMap[i].mode == JOY) {
+            b = buttonMap[i].value.button;
+          }
+          else {
+            b = directionSwitchUp ? buttonMap[i].value.joySwitchable.upButton : buttonMap[i].value.joySwitchable.downButton;
+          }
+          pressJoystickButton(b);
         }
-        if (isModeJoystick()) {
-          if (curButtons[i]) 
-            curJoystick->button(b, 1);
+      }
+      else if (buttonMap[i].mode == TURBO) {
+        if (curButtons[i]) {
+          state->timed = true;
+          if (!prevButtons[i])
+            state->turboStartTime[i] = now;
+          if ((now - state->turboStartTime[i]) / buttonMap[i].value.turbo.halfPeriod % 2 == 0)
+            pressJoystickButton(buttonMap[i].value.turbo.button);
         }
-        else if (isModeX360()) {
-          if (curButtons[i]) 
-            curX360->button(b, 1);
+      }
+      else if (buttonMap[i].mode == MACRO) {
+        if (!prevButtons[i] && curButtons[i])
+          macroStart(buttonMap[i].value.macro, now);
+      }
+      else if (buttonMap[i].mode == MOUSE_RELATIVE) {
+        if (!prevButtons[i] && curButtons[i]) {
+          Mouse.move(buttonMap[i].value.mouseRelative.x, buttonMap[i].value.mouseRelative.y);
+          events = true;
         }
-        else {
-          if (curButtons[i]) 
-            Switch.button(b, 1);
+      }
+      else if (buttonMap[i].mode == CLICK) {
+        if (!prevButtons[i] && curButtons[i]) {
+          Mouse.click(buttonMap[i].value.buttons);
+          events = true;
         }
       }
     }
-    else if (buttonMap[i].mode == MOUSE_RELATIVE) {
-      if (!prevButtons[i] && curButtons[i])
-        Mouse.move(buttonMap[i].value.mouseRelative.x, injector->buttons[i].value.mouseRelative.y);
-    }
-    else if (buttonMap[i].mode == CLICK) {
-      if (!prevButtons[i] && curButtons[i])
-        Mouse.click(buttonMap[i].value.buttons);
+
+    macroUpdate(now);
+
+    if (pressedJoystickButtons != state->reportButtons) {
+      setJoystickButtons(pressedJoystickButtons, state->reportButtons);
+      state->reportButtons = pressedJoystickButtons;
+      send = true;
     }
   }
 
-  if (injector->stick != NULL)
+  // the stick callbacks also set the sliders, over what the exercise machine put there
+  if (injector->stick != NULL && dataChanged) {
     injector->stick(curDataP);
+    send = true;
+    exerciseChanged = true;
+  }
 
-  if (injector->exerciseMachine != NULL)
-    injector->exerciseMachine(curDataP, exerciseMachineP, injector->exerciseMachineMultiplier);
-
-  if (force || memcmp(curReport, prevReport, reportSize)) {
-    if (isModeJoystick()) 
-      curJoystick->send();
-    else if (isModeX360())
-      curX360->send();
-    else 
-      Switch.send();
+  if (exerciseChanged && (injector->exerciseMachine != NULL || injector->exerciseAxes != NULL)) {
+    if (injector->exerciseMachine != NULL)
+      injector->exerciseMachine(curDataP, exerciseMachineP, injector->exerciseMachineMultiplier);
+    if (injector->exerciseAxes != NULL)
+      exerciseMachineAxes(injector->exerciseAxes, exerciseMachineP);
+    send = true;
   }
-}
 
-
+  state->data = *curDataP;
+  state->exerciseMachine = *exerciseMachineP;
+  state->downButton = downButton;
+  state->built = true;
+
+  if (send)
+    sendReport();
+  return send || events;
+}
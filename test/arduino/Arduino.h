@@ -0,0 +1,108 @@
+// Host stand-ins for the parts of the Arduino STM32 core that the sketch uses, so that it can be
+// compiled and exercised on a PC. Time is simulated: it only moves when a test advances it
+// (or when something calls delay()), unless realClock is set.
+
+#ifndef _HOST_ARDUINO_H
+#define _HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int32_t int32;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLDOWN 2
+#define INPUT_ANALOG 3
+#define INPUT_PULLUP 4
+
+#define __I volatile const
+#define __IO volatile
+#define __O volatile
+
+enum {
+  PA0, PA1, PA2, PA3, PA4, PA5, PA6, PA7, PA8, PA9, PA10, PA11, PA12, PA13, PA14, PA15,
+  PB0, PB1, PB2, PB3, PB4, PB5, PB6, PB7, PB8, PB9, PB10, PB11, PB12, PB13, PB14, PB15,
+  NUM_PINS
+};
+
+struct gpio_reg_map { volatile uint32_t IDR; volatile uint32_t ODR; };
+struct gpio_dev { gpio_reg_map* regs; };
+struct adc_reg_map { volatile uint32_t SR, CR1, CR2, SMPR1, SMPR2, JOFR1, JOFR2, JOFR3, JOFR4, HTR, LTR, SQR1, SQR2, SQR3, JSQR, JDR1, JDR2, JDR3, JDR4, DR; };
+struct adc_dev { adc_reg_map* regs; };
+struct stm32_pin_info { gpio_dev* gpio_device; const adc_dev* adc_device; uint8_t gpio_bit; uint8_t adc_channel; };
+
+extern stm32_pin_info PIN_MAP[NUM_PINS];
+extern gpio_dev gpioa;
+extern gpio_dev gpiob;
+extern adc_dev adc1;
+#define GPIOA (&gpioa)
+#define GPIOB (&gpiob)
+#define ADC1 (&adc1)
+
+#define ADC_CR2_ADON (1 << 0)
+#define ADC_CR2_CONT (1 << 1)
+#define ADC_CR2_SWSTART (1 << 22)
+
+// simulated time
+extern volatile uint64_t simMicros;
+extern bool realClock; // use the host's monotonic clock instead, e.g., for tests with threads
+void advanceMicros(uint32_t us);
+static inline void advanceMillis(uint32_t ms) { advanceMicros(ms * 1000); }
+
+uint32_t millis(void);
+uint32_t micros(void);
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+void pinMode(int pin, int mode);
+int digitalRead(int pin);
+void digitalWrite(int pin, int value);
+void setPin(int pin, bool value); // what digitalRead() and Debounce will see
+void analogWrite(int pin, int value);
+int analogRead(int pin);
+void attachInterrupt(int pin, void (*handler)(void), int mode);
+void gpio_write_bit(gpio_dev* dev, uint8_t bit, uint8_t value);
+static inline void noInterrupts(void) {}
+static inline void interrupts(void) {}
+
+typedef enum { TIMER_OUTPUT_COMPARE } timer_mode;
+#define TIMER_CH1 1
+
+class HardwareTimer {
+  public:
+    HardwareTimer(int) {}
+    void pause(void) {}
+    void resume(void) {}
+    void refresh(void) {}
+    uint16_t setPeriod(uint32_t) { return 0; }
+    void setMode(int, timer_mode) {}
+    void setCompare(int, uint16_t) {}
+    void attachInterrupt(int, void (*)(void)) {}
+};
+
+// dwt.h only defines the cycle counter if DWT_BASE isn't defined yet; on the host it counts
+// simulated time at the STM32F103's 72 MHz.
+#define DWT_BASE 0
+#define SystemCoreClock 72000000ul
+typedef struct {
+  volatile uint32_t CTRL;
+  volatile uint32_t CYCCNT;
+} FakeDWT_t;
+extern FakeDWT_t fakeDWT;
+#define DWT (&fakeDWT)
+#define DWTInitTimer() ((void)0)
+
+#endif
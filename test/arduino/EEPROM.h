@@ -0,0 +1 @@
+// Host stand-in: eeprom8.ino only needs EEPROM_PAGE_SIZE, which it defaults itself.
@@ -0,0 +1,61 @@
+// Host stand-in for the GameControllersSTM32 library. The GameCube controller returns whatever a
+// test puts in gameCubeInput while gameCubeConnected is set, and the nunchuck likewise with
+// nunchuckInput and nunchuckConnected; nunchuckReads counts its I2C transactions.
+
+#ifndef _HOST_GAMECONTROLLERS_H
+#define _HOST_GAMECONTROLLERS_H
+
+#include <Arduino.h>
+
+#define CONTROLLER_NONE 0
+#define CONTROLLER_GAMECUBE 1
+#define CONTROLLER_NUNCHUCK 2
+
+typedef struct {
+  uint16_t buttons;
+  uint16_t joystickX;
+  uint16_t joystickY;
+  uint16_t cX;
+  uint16_t cY;
+  uint16_t shoulderLeft;
+  uint16_t shoulderRight;
+  uint8_t device;
+} GameControllerData_t;
+
+extern GameControllerData_t gameCubeInput;
+extern bool gameCubeConnected;
+extern GameControllerData_t nunchuckInput;
+extern bool nunchuckConnected;
+extern volatile unsigned nunchuckReads;
+
+class GameCubeController {
+  public:
+    GameCubeController(uint32_t) {}
+    bool begin(void) { return gameCubeConnected; }
+    void setDPadToJoystick(bool) {}
+    bool readWithRumble(GameControllerData_t* data, bool) {
+      if (!gameCubeConnected)
+        return false;
+      *data = gameCubeInput;
+      data->device = CONTROLLER_GAMECUBE;
+      return true;
+    }
+};
+
+class NunchuckController {
+  public:
+    bool begin(void) {
+      nunchuckReads++;
+      return nunchuckConnected;
+    }
+    bool read(GameControllerData_t* data) {
+      nunchuckReads++;
+      if (!nunchuckConnected)
+        return false;
+      *data = nunchuckInput;
+      data->device = CONTROLLER_NUNCHUCK;
+      return true;
+    }
+};
+
+#endif
@@ -0,0 +1,205 @@
+// Host stand-in for the USBHID_stm32f1 library. Reporters remember what the sketch last put in
+// them and count sends, so tests can look at the reports; feature reports behave like the
+// library's single feature buffer.
+
+#ifndef _HOST_USBCOMPOSITE_H
+#define _HOST_USBCOMPOSITE_H
+
+#include <Arduino.h>
+#include <vector>
+
+#define HID_MOUSE_REPORT_DESCRIPTOR(...) 0x01
+#define HID_KEYBOARD_REPORT_DESCRIPTOR(...) 0x02
+#define HID_JOYSTICK_REPORT_DESCRIPTOR(...) 0x03
+#define HID_FEATURE_REPORT_DESCRIPTOR(...) 0x04
+#define HID_SWITCH_CONTROLLER_REPORT_DESCRIPTOR(...) 0x05
+#define HID_JOYSTICK_REPORT_ID 20
+#define HID_BUFFER_ALLOCATE_SIZE(dataSize, reportID) ((dataSize) + (reportID))
+#define HID_BUFFER_SIZE(dataSize, reportID) ((dataSize) + (reportID))
+
+#define KEY_LEFT_CTRL 0x80
+#define KEY_LEFT_SHIFT 0x81
+#define KEY_LEFT_ALT 0x82
+#define KEY_RIGHT_SHIFT 0x85
+#define KEY_UP_ARROW 0xDA
+#define KEY_DOWN_ARROW 0xD9
+#define KEY_LEFT_ARROW 0xD8
+#define KEY_RIGHT_ARROW 0xD7
+#define KEY_BACKSPACE 0xB2
+#define KEY_RETURN 0xB0
+
+#define XBOX_DUP 1
+#define XBOX_DDOWN 2
+#define XBOX_DLEFT 3
+#define XBOX_DRIGHT 4
+#define XBOX_START 5
+#define XBOX_BACK 6
+#define XBOX_L3 7
+#define XBOX_R3 8
+#define XBOX_LSHOULDER 9
+#define XBOX_RSHOULDER 10
+#define XBOX_GUIDE 11
+#define XBOX_A 13
+#define XBOX_B 14
+#define XBOX_X 15
+#define XBOX_Y 16
+
+struct HIDBuffer_t {
+  uint8_t* buffer;
+  uint16_t bufferSize;
+  uint8_t reportID;
+};
+
+class USBHID {
+  public:
+    void setTXInterval(int) {}
+    void begin(const uint8_t*, uint16_t) {}
+    template<class T> void begin(T&, const uint8_t*, uint16_t) {}
+    void end(void) {}
+    void clearBuffers(void) {}
+    void addFeatureBuffer(volatile HIDBuffer_t*) {}
+};
+
+class HIDReporter {
+  public:
+    unsigned sends = 0;
+    uint8_t feature[64] = {0}; // what the host reads with GET_FEATURE
+    bool featureReceived = false; // the host wrote feature[] with SET_FEATURE and the sketch hasn't read it
+
+    void setManualReportMode(bool) {}
+    void send(void) { sends++; }
+    void end(void) {}
+    void setFeature(uint8_t* f) { strncpy((char*)feature, (const char*)f, sizeof(feature) - 1); }
+    bool getFeature(uint8_t* f) {
+      if (!featureReceived)
+        return false;
+      featureReceived = false;
+      memcpy(f, feature, sizeof(feature) - 1);
+      return true;
+    }
+};
+
+class HIDJoystick : public HIDReporter {
+  public:
+    uint32_t buttonBits = 0; // bit n-1 is button n
+    uint16_t x = 512, y = 512, xRotate = 512, yRotate = 512, sliderLeftValue = 512, sliderRightValue = 512;
+    int16_t hatDirection = -1;
+
+    HIDJoystick(USBHID&, uint8_t = HID_JOYSTICK_REPORT_ID) {}
+    void X(uint16_t v) { x = v; }
+    void Y(uint16_t v) { y = v; }
+    void Xrotate(uint16_t v) { xRotate = v; }
+    void Yrotate(uint16_t v) { yRotate = v; }
+    void sliderLeft(uint16_t v) { sliderLeftValue = v; }
+    void sliderRight(uint16_t v) { sliderRightValue = v; }
+    void hat(int16_t d) { hatDirection = d; }
+    void buttons(uint32_t b) { buttonBits = b; }
+    void button(uint8_t b, bool v) {
+      if (b < 1 || b > 32)
+        return;
+      if (v)
+        buttonBits |= 1ul << (b - 1);
+      else
+        buttonBits &= ~(1ul << (b - 1));
+    }
+};
+
+class HIDSwitchController : public HIDReporter {
+  public:
+    enum { BUTTON_Y, BUTTON_B, BUTTON_A, BUTTON_X, BUTTON_L, BUTTON_R, BUTTON_ZL, BUTTON_ZR,
+      BUTTON_MINUS, BUTTON_PLUS, BUTTON_LEFT_CLICK, BUTTON_RIGHT_CLICK, BUTTON_HOME, BUTTON_CAPTURE };
+    enum { DPAD_NEUTRAL = 8 };
+    uint32_t buttonBits = 0;
+    uint8_t x = 128, y = 128, xRight = 128, yRight = 128, dpadDirection = DPAD_NEUTRAL;
+
+    HIDSwitchController(USBHID&) {}
+    void X(uint8_t v) { x = v; }
+    void Y(uint8_t v) { y = v; }
+    void XRight(uint8_t v) { xRight = v; }
+    void YRight(uint8_t v) { yRight = v; }
+    void dpad(uint8_t d) { dpadDirection = d; }
+    void buttons(uint32_t b) { buttonBits = b; }
+    void button(uint8_t b, bool v) {
+      if (v)
+        buttonBits |= 1ul << b;
+      else
+        buttonBits &= ~(1ul << b);
+    }
+};
+
+struct KeyEvent {
+  uint32_t time;
+  uint8_t key;
+  bool press;
+};
+
+class HIDKeyboard {
+  public:
+    std::vector<KeyEvent> events;
+
+    HIDKeyboard(USBHID&) {}
+    void press(uint8_t k) { events.push_back({ millis(), k, true }); }
+    void release(uint8_t k) { events.push_back({ millis(), k, false }); }
+    void releaseAll(void) {}
+};
+
+class HIDMouse {
+  public:
+    HIDMouse(USBHID&) {}
+    void move(int, int) {}
+    void click(uint8_t) {}
+    void release(uint8_t) {}
+};
+
+class USBXBox360Controller : public HIDReporter {
+  public:
+    uint32_t buttonBits = 0;
+    int16_t x = 0, y = 0, xRight = 0, yRight = 0;
+    uint8_t sliderLeftValue = 0, sliderRightValue = 0;
+
+    void X(int16_t v) { x = v; }
+    void Y(int16_t v) { y = v; }
+    void XRight(int16_t v) { xRight = v; }
+    void YRight(int16_t v) { yRight = v; }
+    void sliderLeft(uint8_t v) { sliderLeftValue = v; }
+    void sliderRight(uint8_t v) { sliderRightValue = v; }
+    void buttons(uint16_t b) { buttonBits = b; }
+    void button(uint8_t b, bool v) {
+      if (v)
+        buttonBits |= 1ul << b;
+      else
+        buttonBits &= ~(1ul << b);
+    }
+    void setRumbleCallback(void (*)(uint8, uint8)) {}
+};
+
+class USBXBox360 : public USBXBox360Controller {
+  public:
+    void begin(void) {}
+};
+
+template<int n> class USBMultiXBox360 {
+  public:
+    USBXBox360Controller controllers[n];
+    void begin(void) {}
+    void end(void) {}
+};
+
+class USBCompositeDevice {
+  public:
+    bool ready = true;
+    void setProductString(const char*) {}
+    void setManufacturerString(const char*) {}
+    void setVendorId(uint16_t) {}
+    void setProductId(uint16_t) {}
+    bool isReady(void) { return ready; }
+};
+
+extern USBCompositeDevice USBComposite;
+
+class USBCompositeSerial {
+  public:
+    template<class T> void println(T) {}
+};
+
+#endif
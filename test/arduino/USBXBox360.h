@@ -0,0 +1 @@
+#include <USBComposite.h>
@@ -0,0 +1,162 @@
+// Definitions for the host stand-ins declared in this directory's headers.
+
+#include <Arduino.h>
+#include <USBComposite.h>
+#include <GameControllers.h>
+#include <flash_stm32.h>
+
+#include <chrono>
+#include <thread>
+#include <sys/mman.h>
+
+static gpio_reg_map gpioaRegs;
+static gpio_reg_map gpiobRegs;
+static adc_reg_map adc1Regs;
+gpio_dev gpioa = { &gpioaRegs };
+gpio_dev gpiob = { &gpiobRegs };
+adc_dev adc1 = { &adc1Regs };
+
+// constant-initialized, so that Debounce constructors in other files can use it
+#define PORT_A(n) { &gpioa, NULL, n, 0 }
+#define PORT_B(n) { &gpiob, NULL, n, 0 }
+stm32_pin_info PIN_MAP[NUM_PINS] = {
+  PORT_A(0), PORT_A(1), PORT_A(2), PORT_A(3), PORT_A(4), PORT_A(5), PORT_A(6), PORT_A(7),
+  PORT_A(8), PORT_A(9), PORT_A(10), PORT_A(11), PORT_A(12), PORT_A(13), PORT_A(14), PORT_A(15),
+  { &gpiob, &adc1, 0, 8 }, { &gpiob, &adc1, 1, 9 }, PORT_B(2), PORT_B(3), PORT_B(4), PORT_B(5), PORT_B(6), PORT_B(7),
+  PORT_B(8), PORT_B(9), PORT_B(10), PORT_B(11), PORT_B(12), PORT_B(13), PORT_B(14), PORT_B(15),
+};
+
+volatile uint64_t simMicros = 0;
+bool realClock = false;
+FakeDWT_t fakeDWT;
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+static uint64_t nowMicros(void) {
+  if (realClock)
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+  else
+    return simMicros;
+}
+
+void advanceMicros(uint32_t us) {
+  simMicros += us;
+  fakeDWT.CYCCNT += us * (SystemCoreClock / 1000000ul);
+}
+
+uint32_t millis(void) {
+  return (uint32_t)(nowMicros() / 1000);
+}
+
+uint32_t micros(void) {
+  return (uint32_t)nowMicros();
+}
+
+void delayMicroseconds(uint32_t us) {
+  if (realClock)
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+  else
+    advanceMicros(us);
+}
+
+void delay(uint32_t ms) {
+  delayMicroseconds(ms * 1000);
+}
+
+void pinMode(int, int) {
+}
+
+void setPin(int pin, bool value) {
+  gpio_reg_map* regs = PIN_MAP[pin].gpio_device->regs;
+  if (value)
+    regs->IDR |= 1u << PIN_MAP[pin].gpio_bit;
+  else
+    regs->IDR &= ~(1u << PIN_MAP[pin].gpio_bit);
+}
+
+int digitalRead(int pin) {
+  return (PIN_MAP[pin].gpio_device->regs->IDR >> PIN_MAP[pin].gpio_bit) & 1;
+}
+
+void digitalWrite(int pin, int value) {
+  gpio_write_bit(PIN_MAP[pin].gpio_device, PIN_MAP[pin].gpio_bit, value);
+}
+
+void gpio_write_bit(gpio_dev* dev, uint8_t bit, uint8_t value) {
+  if (value)
+    dev->regs->ODR |= 1u << bit;
+  else
+    dev->regs->ODR &= ~(1u << bit);
+}
+
+void analogWrite(int, int) {
+}
+
+int analogRead(int pin) {
+  return PIN_MAP[pin].adc_device != NULL ? PIN_MAP[pin].adc_device->regs->DR & 0xFFF : 0;
+}
+
+void attachInterrupt(int, void (*)(void), int) {
+}
+
+USBCompositeDevice USBComposite;
+
+GameControllerData_t gameCubeInput = { 0, 512, 512, 512, 512, 0, 0, CONTROLLER_GAMECUBE };
+bool gameCubeConnected = true;
+GameControllerData_t nunchuckInput = { 0, 512, 512, 512, 512, 0, 0, CONTROLLER_NUNCHUCK };
+bool nunchuckConnected = false;
+volatile unsigned nunchuckReads = 0;
+
+// STM32F1 datasheet maximums
+uint32_t flashEraseMicros = 40000;
+uint32_t flashProgramMicros = 70;
+unsigned flashErases = 0;
+unsigned flashPrograms = 0;
+
+static const uintptr_t flashBase = 0x08000000;
+static const uintptr_t flashSizeRegister = 0x1FFFF7E0;
+static const uint32_t flashPageSize = 0x400;
+
+static bool mapAt(uintptr_t address, size_t size) {
+  uintptr_t start = address & ~(uintptr_t)0xFFF;
+  size = (address + size - start + 0xFFF) & ~(size_t)0xFFF;
+  void* p = mmap((void*)start, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  return p == (void*)start;
+}
+
+bool fakeFlashBegin(uint32_t sizeKB) {
+  static bool mapped = false;
+  if (!mapped) {
+    if (!mapAt(flashBase, 128 * 1024) || !mapAt(flashSizeRegister, 2))
+      return false;
+    mapped = true;
+  }
+  if (sizeKB > 128)
+    return false;
+  memset((void*)flashBase, 0xFF, sizeKB * 1024);
+  *(volatile uint16_t*)flashSizeRegister = sizeKB;
+  return true;
+}
+
+void FLASH_Unlock(void) {
+}
+
+void FLASH_Lock(void) {
+}
+
+FLASH_Status FLASH_ErasePage(uint32_t address) {
+  memset((void*)(uintptr_t)(address & ~(flashPageSize - 1)), 0xFF, flashPageSize);
+  advanceMicros(flashEraseMicros);
+  flashErases++;
+  return FLASH_COMPLETE;
+}
+
+FLASH_Status FLASH_ProgramHalfWord(uint32_t address, uint16_t data) {
+  volatile uint16_t* p = (volatile uint16_t*)(uintptr_t)address;
+  advanceMicros(flashProgramMicros);
+  flashPrograms++;
+  if (*p != 0xFFFF)
+    return FLASH_ERROR_PG;
+  *p = data;
+  return FLASH_COMPLETE;
+}
@@ -0,0 +1,30 @@
+// Host stand-in for the STM32F1 flash driver. fakeFlashBegin() maps memory where the flash and
+// the flash size register are on the chip, so eeprom8.ino can use its addresses unchanged. Each
+// operation advances simulated time by what it takes on the chip.
+
+#ifndef _HOST_FLASH_STM32_H
+#define _HOST_FLASH_STM32_H
+
+#include <Arduino.h>
+
+typedef enum {
+  FLASH_BUSY = 1,
+  FLASH_ERROR_PG,
+  FLASH_ERROR_WRP,
+  FLASH_COMPLETE,
+  FLASH_TIMEOUT
+} FLASH_Status;
+
+extern uint32_t flashEraseMicros;   // page erase
+extern uint32_t flashProgramMicros; // half-word program
+extern unsigned flashErases;
+extern unsigned flashPrograms;
+
+bool fakeFlashBegin(uint32_t sizeKB);
+
+void FLASH_Unlock(void);
+void FLASH_Lock(void);
+FLASH_Status FLASH_ErasePage(uint32_t address);
+FLASH_Status FLASH_ProgramHalfWord(uint32_t address, uint16_t data);
+
+#endif
@@ -0,0 +1,13 @@
+// Host stand-in for the libmaple watchdog: it never fires.
+
+#ifndef _HOST_IWDG_H
+#define _HOST_IWDG_H
+
+#include <stdint.h>
+
+#define IWDG_PRE_256 6
+
+static inline void iwdg_init(int, uint32_t) {}
+static inline void iwdg_feed(void) {}
+
+#endif
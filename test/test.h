@@ -0,0 +1,47 @@
+// Compiles the whole sketch into the including test, with the .ino files in the order the Arduino
+// IDE puts them together, so tests can reach file-local functions and state. Tests may #define
+// optional features (ENABLE_CRANK_SENSOR etc.) before including this.
+
+#ifndef _TEST_H
+#define _TEST_H
+
+#include <Arduino.h>
+#include <stdio.h>
+
+#include "../gamecubecontroller.ino"
+#include "../eeprom8.ino"
+#include "../exercisemachine.ino"
+#include "../macro.ino"
+#include "../remap.ino"
+#include "../x360.ino"
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQUAL(expected, actual) do { \
+    long long _e = (long long)(expected), _a = (long long)(actual); \
+    if (_e != _a) { \
+      printf("%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #expected, #actual, _e, _a); \
+      failures++; \
+    } \
+  } while (0)
+
+static int testResult(const char* name) {
+  printf("%s: %s\n", name, failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+static const Injector_t* findInjector(const char* commandName) {
+  for (unsigned i = 0; i < numInjectionModes; i++)
+    if (0 == strcmp(injectors[i].commandName, commandName))
+      return injectors + i;
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,154 @@
+// Settings storage on a simulated flash, where a page erase takes 40 ms and a half-word program
+// 70 us of simulated time, as on the STM32F103. A 5 ms loop commits one step per pass, the way
+// loop() does, and the longest stall is reported for when the controls are in use and when they
+// are idle. Then loop() itself runs with a noisy stick and with held buttons, to check when it
+// lets the erase happen.
+
+#include "test.h"
+
+static uint32_t worstStall;
+
+// one pass of the loop as far as the settings go; returns the stall in microseconds
+static uint32_t commitPass(bool idle) {
+  advanceMicros(pollPeriodMicros);
+  uint64_t start = simMicros;
+  commitSettings(idle);
+  uint32_t stall = simMicros - start;
+  if (stall > worstStall)
+    worstStall = stall;
+  return stall;
+}
+
+// commits until a few passes in a row have nothing to do; returns the number of passes that did
+static unsigned commitAll(bool idle, unsigned maxPasses) {
+  unsigned passes = 0, quiet = 0;
+  for (unsigned i = 0; i < maxPasses && quiet < 3; i++) {
+    if (commitPass(idle) != 0) {
+      passes++;
+      quiet = 0;
+    }
+    else {
+      quiet++;
+    }
+  }
+  return passes;
+}
+
+static void checkActiveAndIdle(void) {
+  CHECK(fakeFlashBegin(64));
+  EEPROM8_init();
+  commitAll(true, 1000);
+
+  // a dozen variables change every 50 ms while the controls are in use, which fills the page
+  // several times over
+  worstStall = 0;
+  maxSaveStallCycles = 0;
+  unsigned erases = flashErases;
+  for (unsigned pass = 0; pass < 2000; pass++) {
+    if (pass % 10 == 0)
+      for (uint8_t v = 1; v <= 12; v++)
+        EEPROM8_storeValue(v, (uint8_t)(pass / 10 + v));
+    commitPass(false);
+  }
+  uint32_t activeStall = worstStall;
+  CHECK_EQUAL(erases, flashErases);
+  CHECK(activeStall <= flashProgramMicros);
+  CHECK_EQUAL(activeStall, maxSaveStallCycles / (SystemCoreClock / 1000000ul));
+  // staged in RAM all along
+  for (uint8_t v = 1; v <= 12; v++)
+    CHECK_EQUAL((uint8_t)(1999 / 10 + v), EEPROM8_getValue(v));
+
+  // the controls go idle: the page is erased once, and what was staged is written back
+  worstStall = 0;
+  unsigned passes = commitAll(true, 1000);
+  uint32_t idleStall = worstStall;
+  CHECK_EQUAL(erases + 1, flashErases);
+  CHECK_EQUAL(flashEraseMicros + 2 * flashProgramMicros, idleStall);
+  printf("eeprom: worst stall %u us while active, %u us once idle (%u passes to catch up)\n",
+    activeStall, idleStall, passes);
+
+  EEPROM8_init();
+  for (uint8_t v = 1; v <= 12; v++)
+    CHECK_EQUAL((uint8_t)(1999 / 10 + v), EEPROM8_getValue(v));
+}
+
+// values written before the page fills, and after an erase, read back after a restart
+static void checkPersistence(void) {
+  CHECK(fakeFlashBegin(64));
+  EEPROM8_init();
+  EEPROM8_storeValue(EEPROM_VARIABLE_INJECTION_MODE, 7);
+  EEPROM8_storeValue(200, 99);
+  commitAll(false, 1000);
+  EEPROM8_init();
+  CHECK_EQUAL(7, EEPROM8_getValue(EEPROM_VARIABLE_INJECTION_MODE));
+  CHECK_EQUAL(99, EEPROM8_getValue(200));
+
+  // fill the page with one variable; a change staged after that only reaches flash with the
+  // idle erase, so a restart before then comes back with the value from before
+  for (unsigned i = 0; i < EEPROM_PAGE_SIZE; i++) {
+    EEPROM8_storeValue(5, (uint8_t)i);
+    commitPass(false);
+  }
+  EEPROM8_storeValue(200, 100);
+  commitAll(false, 10);
+  EEPROM8_init();
+  CHECK_EQUAL(7, EEPROM8_getValue(EEPROM_VARIABLE_INJECTION_MODE));
+  CHECK_EQUAL(99, EEPROM8_getValue(200));
+
+  EEPROM8_storeValue(200, 100);
+  EEPROM8_storeValue(5, 42);
+  commitAll(true, 1000);
+  EEPROM8_init();
+  CHECK_EQUAL(7, EEPROM8_getValue(EEPROM_VARIABLE_INJECTION_MODE));
+  CHECK_EQUAL(100, EEPROM8_getValue(200));
+  CHECK_EQUAL(42, EEPROM8_getValue(5));
+}
+
+// Runs loop() for ms milliseconds of controller polls, with the stick drifting by up to
+// stickNoise, and returns when the first erase happened, or 0 if there was none.
+static uint32_t loopUntilErase(uint32_t ms, uint16_t buttons, uint16_t stickNoise) {
+  static uint32_t seed = 1;
+  unsigned erases = flashErases;
+  uint32_t start = millis();
+  while (millis() - start < ms) {
+    advanceMicros(pollPeriodMicros);
+    seed = seed * 1103515245 + 12345;
+    uint16_t noise = stickNoise ? (seed >> 16) % (2 * stickNoise + 1) : 0;
+    gameCubeInput = { buttons, (uint16_t)(600 + noise), (uint16_t)(400 - noise), 512, 512, 0, 0, CONTROLLER_GAMECUBE };
+    pollControllers();
+    loop();
+    if (flashErases != erases)
+      return millis() - start;
+  }
+  return 0;
+}
+
+static void checkLoopIdleDetection(void) {
+  CHECK(fakeFlashBegin(64));
+  EEPROM8_init();
+  gameCubeConnected = true;
+  validUSB = 1;
+
+  // noise spanning idleTolerance on a stick that is held still doesn't put the erase off...
+  EEPROM8_reset();
+  loopUntilErase(100, maskA, 0);
+  uint32_t t = loopUntilErase(5000, 0, idleTolerance / 2);
+  CHECK(t >= eraseSettingsAfterIdleMillis && t < eraseSettingsAfterIdleMillis + 100);
+
+  // ...but buttons do, for as long as they're held
+  EEPROM8_reset();
+  CHECK_EQUAL(0, loopUntilErase(5000, maskA, 0));
+  t = loopUntilErase(5000, 0, 0);
+  CHECK(t >= eraseSettingsAfterIdleMillis && t < eraseSettingsAfterIdleMillis + 100);
+  CHECK_EQUAL(0, loopUntilErase(5000, 0, 0));
+}
+
+int main() {
+  advanceMillis(100000);
+
+  checkActiveAndIdle();
+  checkPersistence();
+  checkLoopIdleDetection();
+
+  return testResult("eeprom");
+}
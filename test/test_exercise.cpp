@@ -0,0 +1,205 @@
+// Pulse trains from the wheel, crank and heart rate sensors against a simulated clock: the
+// interrupt handlers fire at the pulse times, and exerciseMachineUpdate() runs every 5 ms as
+// loop() would. Also the resistance knob's hysteresis, and which exercise readings make which
+// injectors send.
+
+#define ENABLE_CRANK_SENSOR
+#define ENABLE_HEART_RATE_SENSOR
+#define ENABLE_RESISTANCE_KNOB
+
+#include "test.h"
+
+// a sensor pulsing every periodMicros (0 for not at all), with one-off extra glitch pulses
+struct PulseTrain {
+  void (*interrupt)(void);
+  uint32_t periodMicros;
+  uint64_t next;
+  uint64_t glitchAt;
+
+  void start(uint32_t period) {
+    periodMicros = period;
+    next = simMicros + period;
+  }
+
+  void fire(void) {
+    if (periodMicros != 0 && simMicros >= next) {
+      interrupt();
+      next += periodMicros;
+    }
+    if (glitchAt != 0 && simMicros >= glitchAt) {
+      interrupt();
+      glitchAt = 0;
+    }
+  }
+};
+
+static PulseTrain wheelTrain = { exerciseMachineInterrupt };
+static PulseTrain crankTrain = { crankInterrupt };
+static PulseTrain heartTrain = { heartRateInterrupt };
+static ExerciseMachineData_t machine;
+
+static uint32_t rpmPeriod(uint32_t rpm) {
+  return 60000000ul / rpm;
+}
+
+// what updateRotationSpeed() reports for a steady rate
+static int32_t expectedSpeed(uint32_t rpm) {
+  uint32_t periodMillis = 60000 / rpm;
+  if (periodMillis < shortestReasonableRotationTime)
+    periodMillis = shortestReasonableRotationTime;
+  return MAX_SPEED_VALUE * shortestReasonableRotationTime / periodMillis;
+}
+
+static void run(uint32_t ms) {
+  for (uint32_t i = 0; i < ms; i++) {
+    advanceMicros(1000);
+    wheelTrain.fire();
+    crankTrain.fire();
+    heartTrain.fire();
+    if (millis() % 5 == 0)
+      exerciseMachineUpdate(&machine);
+  }
+}
+
+static bool near(int32_t expected, int32_t actual) {
+  return actual >= expected - 1 && actual <= expected + 1;
+}
+
+static void checkSteadyRates(void) {
+  // the wheel at 60 RPM, the crank at 90, the heart at 120 bpm, all at once
+  wheelTrain.start(rpmPeriod(60));
+  crankTrain.start(rpmPeriod(90));
+  heartTrain.start(rpmPeriod(120));
+  run(5000);
+  CHECK(machine.valid);
+  CHECK(near(expectedSpeed(60), machine.speed));
+  CHECK(near(expectedSpeed(90), machine.cadence));
+  CHECK_EQUAL(120, machine.heartRate);
+
+  // faster than the best reasonable rate saturates
+  wheelTrain.start(rpmPeriod(200));
+  run(2000);
+  CHECK_EQUAL(MAX_SPEED_VALUE, machine.speed);
+  wheelTrain.start(rpmPeriod(60));
+  run(3000);
+  CHECK(near(expectedSpeed(60), machine.speed));
+}
+
+// pulses closer together than the shortest allowed period are taken as glitches
+static void checkGlitches(void) {
+  wheelTrain.glitchAt = wheelTrain.next + shortestAllowedRotationTime * 1000 / 2;
+  crankTrain.glitchAt = crankTrain.next + shortestAllowedRotationTime * 1000 / 2;
+  heartTrain.glitchAt = heartTrain.next + shortestAllowedHeartBeatTime * 1000 / 2;
+  for (int i = 0; i < 3000; i += 5) {
+    run(5);
+    CHECK(near(expectedSpeed(60), machine.speed));
+    CHECK(near(expectedSpeed(90), machine.cadence));
+    CHECK_EQUAL(120, machine.heartRate);
+  }
+}
+
+// when the pulses stop, speed decays as if the next pulse were just about to come, and then drops
+// to zero; the heart rate drops to zero once a beat is overdue
+static void checkStopping(void) {
+  wheelTrain.start(0);
+  crankTrain.start(0);
+  heartTrain.start(0);
+  int32_t lastSpeed = machine.speed, lastCadence = machine.cadence;
+  uint32_t stopped = millis();
+  bool heartStopped = false;
+  while (millis() - stopped < longestReasonableRotationTime + 100) {
+    run(5);
+    CHECK(machine.speed <= lastSpeed);
+    CHECK(machine.cadence <= lastCadence);
+    lastSpeed = machine.speed;
+    lastCadence = machine.cadence;
+    if (machine.heartRate == 0 && !heartStopped) {
+      heartStopped = true;
+      uint32_t dt = millis() - stopped;
+      CHECK(dt > longestReasonableHeartBeatTime - 500 && dt <= longestReasonableHeartBeatTime + 10);
+    }
+  }
+  CHECK(heartStopped);
+  CHECK_EQUAL(0, machine.speed);
+  CHECK_EQUAL(0, machine.cadence);
+  CHECK(!machine.valid);
+}
+
+static void setKnob(uint16_t adc12) {
+  resistanceADC->DR = adc12;
+  exerciseMachineUpdate(&machine);
+}
+
+static void checkKnobHysteresis(void) {
+  setKnob(2000);
+  uint16_t settled = machine.resistance;
+  CHECK_EQUAL(500, settled);
+  // ADC noise of a couple of 10-bit counts either way
+  static const int16_t noise[] = { 3, -5, 8, -8, 11, -11, 0 };
+  for (int16_t n : noise) {
+    setKnob(2000 + n);
+    CHECK_EQUAL(settled, machine.resistance);
+  }
+  setKnob(2000 + 16);
+  CHECK_EQUAL(504, machine.resistance);
+  setKnob(2000);
+  CHECK_EQUAL(500, machine.resistance);
+
+  // both ends of the travel are reachable, even from within the hysteresis band
+  setKnob(4 * 2);
+  setKnob(0);
+  CHECK_EQUAL(0, machine.resistance);
+  setKnob(4095 - 4 * 2);
+  setKnob(4095);
+  CHECK_EQUAL(1023, machine.resistance);
+}
+
+static unsigned sendsFor(const Injector_t* injector, const ExerciseMachineData_t& data) {
+  GameControllerData_t controller = { 0, 512, 512, 512, 512, 0, 0, CONTROLLER_GAMECUBE };
+  unsigned sends = Joystick.sends;
+  inject(&Joystick, NULL, injector, &controller, &data);
+  return Joystick.sends - sends;
+}
+
+static void checkRelevantChannels(void) {
+  ExerciseMachineData_t base = { 100, 1, 1, 200, 80, 300 };
+  ExerciseMachineData_t heart = base, cadence = base, knob = base, speed = base;
+  heart.heartRate++;
+  cadence.cadence++;
+  knob.resistance++;
+  speed.speed++;
+
+  // the sliders only follow the wheel
+  const Injector_t* sliders = findInjector("defaultUnified");
+  sendsFor(sliders, base);
+  CHECK_EQUAL(0, sendsFor(sliders, base));
+  CHECK_EQUAL(0, sendsFor(sliders, heart));
+  CHECK_EQUAL(0, sendsFor(sliders, cadence));
+  CHECK_EQUAL(0, sendsFor(sliders, knob));
+  CHECK_EQUAL(1, sendsFor(sliders, speed));
+
+  // bikeSensorAxes has all four channels
+  const Injector_t* axes = findInjector("bikeSensors");
+  sendsFor(axes, base);
+  CHECK_EQUAL(0, sendsFor(axes, base));
+  CHECK_EQUAL(1, sendsFor(axes, heart));
+  CHECK_EQUAL(1, sendsFor(axes, cadence));
+  CHECK_EQUAL(1, sendsFor(axes, knob));
+  CHECK_EQUAL(1, sendsFor(axes, speed));
+  // validity only matters to the exerciseMachine callback, which this one doesn't have
+  speed.valid = 0;
+  CHECK_EQUAL(0, sendsFor(axes, speed));
+}
+
+int main() {
+  advanceMillis(100000);
+  exerciseMachineInit();
+
+  checkSteadyRates();
+  checkGlitches();
+  checkStopping();
+  checkKnobHysteresis();
+  checkRelevantChannels();
+
+  return testResult("exercise");
+}
@@ -0,0 +1,162 @@
+// What inject() sends for repeated, noisy and changing controller data, and how long it takes
+// per call when there's nothing to do and when there is.
+
+// for the direction switch
+#define ENABLE_EXERCISE_MACHINE
+
+#include "test.h"
+
+#include <chrono>
+
+static const ExerciseMachineData_t exerciseMachine = { 0, 1, 0 };
+
+static GameControllerData_t controller(uint16_t buttons, uint16_t x = 512, uint16_t y = 512) {
+  GameControllerData_t data = { buttons, x, y, 512, 512, 0, 0, CONTROLLER_GAMECUBE };
+  return data;
+}
+
+static bool injectData(const Injector_t* injector, const GameControllerData_t& data) {
+  return inject(&Joystick, NULL, injector, &data, &exerciseMachine);
+}
+
+static void checkRepeats(void) {
+  const Injector_t* injector = findInjector("defaultUnified");
+  GameControllerData_t data = controller(maskA, 700, 300);
+  CHECK(injectData(injector, data));
+  unsigned sends = Joystick.sends;
+  for (int i = 0; i < 10; i++)
+    CHECK(!injectData(injector, data));
+  CHECK_EQUAL(sends, Joystick.sends);
+}
+
+// without a stick callback, the stick only matters where it crosses into a direction
+static void checkStickNoise(void) {
+  const Injector_t* wasd = findInjector("wasd");
+  injectData(wasd, controller(0));
+  unsigned sends = Joystick.sends;
+  size_t events = Keyboard.events.size();
+  for (int i = 0; i < 10; i++)
+    CHECK(!injectData(wasd, controller(0, 512 + i % 3 * 7, 512 - i % 2 * 5)));
+  CHECK_EQUAL(sends, Joystick.sends);
+  CHECK_EQUAL(events, Keyboard.events.size());
+
+  // all the way right is 'd', which is a key press and no report
+  CHECK(injectData(wasd, controller(0, 1023, 512)));
+  CHECK_EQUAL(sends, Joystick.sends);
+  CHECK_EQUAL(events + 1, Keyboard.events.size());
+  CHECK(Keyboard.events.back().key == 'd' && Keyboard.events.back().press);
+
+  // with one, every change is reported
+  const Injector_t* joystick = findInjector("defaultUnified");
+  injectData(joystick, controller(0));
+  sends = Joystick.sends;
+  CHECK(injectData(joystick, controller(0, 519, 512)));
+  CHECK_EQUAL(sends + 1, Joystick.sends);
+  CHECK_EQUAL(519, Joystick.x);
+}
+
+static void checkButtons(void) {
+  // A is the space bar, which needs no report
+  const Injector_t* wasd = findInjector("wasd");
+  injectData(wasd, controller(0));
+  unsigned sends = Joystick.sends;
+  CHECK(injectData(wasd, controller(maskA)));
+  CHECK(!injectData(wasd, controller(maskA)));
+  CHECK(injectData(wasd, controller(0)));
+  CHECK_EQUAL(sends, Joystick.sends);
+
+  // Y and Start are joystick buttons 4 and 5
+  const Injector_t* turbo = findInjector("turbo");
+  injectData(turbo, controller(0));
+  sends = Joystick.sends;
+  CHECK_EQUAL(0, Joystick.buttonBits);
+  CHECK(injectData(turbo, controller(maskY)));
+  CHECK(!injectData(turbo, controller(maskY)));
+  CHECK_EQUAL(sends + 1, Joystick.sends);
+  CHECK_EQUAL(1 << 3, Joystick.buttonBits);
+  CHECK(injectData(turbo, controller(maskY | maskStart)));
+  CHECK_EQUAL(1 << 3 | 1 << 4, Joystick.buttonBits);
+  CHECK(injectData(turbo, controller(maskStart)));
+  CHECK_EQUAL(1 << 4, Joystick.buttonBits);
+  CHECK(injectData(turbo, controller(0)));
+  CHECK_EQUAL(0, Joystick.buttonBits);
+  CHECK_EQUAL(sends + 4, Joystick.sends);
+}
+
+// a held turbo button only needs a report when it toggles
+static void checkTurboSends(void) {
+  const Injector_t* turbo = findInjector("turbo");
+  injectData(turbo, controller(0));
+  unsigned sends = Joystick.sends;
+  for (int ms = 0; ms < 330; ms++) {
+    injectData(turbo, controller(maskA));
+    advanceMillis(1);
+  }
+  // pressed, then 9 toggles every 33 ms
+  CHECK_EQUAL(sends + 10, Joystick.sends);
+}
+
+// In Switch mode, pressing the right shoulder all the way in is ZR with the direction switch
+// forward and A with it back, on top of the ZR that pressing it part way already gives, so
+// flipping the switch with the shoulder held changes the report by itself.
+static void checkDirectionSwitch(void) {
+  const Injector_t* injector = findInjector("switch");
+  const USBMode_t* mode = currentUSBMode;
+  currentUSBMode = &modeSwitch;
+  GameControllerData_t held = controller(maskShoulderRight);
+  held.shoulderRight = 255;
+  setPin(directionSwitch, DIRECTION_SWITCH_FORWARD);
+  injectData(injector, held);
+  unsigned sends = Switch.sends;
+  uint32_t forward = Switch.buttonBits;
+  CHECK_EQUAL(1 << HIDSwitchController::BUTTON_ZR, forward);
+  CHECK(!injectData(injector, held));
+
+  setPin(directionSwitch, !DIRECTION_SWITCH_FORWARD);
+  CHECK(injectData(injector, held));
+  CHECK_EQUAL(1 << HIDSwitchController::BUTTON_ZR | 1 << HIDSwitchController::BUTTON_A, Switch.buttonBits);
+  CHECK(!injectData(injector, held));
+  setPin(directionSwitch, DIRECTION_SWITCH_FORWARD);
+  CHECK(injectData(injector, held));
+  CHECK_EQUAL(forward, Switch.buttonBits);
+  CHECK_EQUAL(sends + 2, Switch.sends);
+
+  currentUSBMode = mode;
+}
+
+template<class F> static double nanosPerCall(unsigned calls, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < calls; i++)
+    f(i);
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+}
+
+static void benchmark(void) {
+  const unsigned calls = 1000000;
+  const Injector_t* joystick = findInjector("defaultUnified");
+  const Injector_t* wasd = findInjector("wasd");
+  GameControllerData_t data[2] = { controller(0, 600, 400), controller(0, 601, 400) };
+  GameControllerData_t buttons[2] = { controller(maskA), controller(maskB) };
+
+  injectData(joystick, data[0]);
+  double idle = nanosPerCall(calls, [&](unsigned) { injectData(joystick, data[0]); });
+  double stick = nanosPerCall(calls, [&](unsigned i) { injectData(joystick, data[i & 1]); });
+  double button = nanosPerCall(calls, [&](unsigned i) { injectData(joystick, buttons[i & 1]); });
+  injectData(wasd, data[0]);
+  double noise = nanosPerCall(calls, [&](unsigned i) { injectData(wasd, data[i & 1]); });
+  printf("inject: ns per call: idle %.1f, stick moving %.1f, buttons changing %.1f, "
+    "stick noise without a stick callback %.1f\n", idle, stick, button, noise);
+}
+
+int main() {
+  advanceMillis(100000);
+
+  checkRepeats();
+  checkStickNoise();
+  checkButtons();
+  checkTurboSends();
+  checkDirectionSwitch();
+  benchmark();
+
+  return testResult("inject");
+}
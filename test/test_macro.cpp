@@ -0,0 +1,179 @@
+// Timing of MACRO and TURBO buttons against a simulated clock. Reports are built at irregular
+// intervals, and every report has to show exactly what the schedule says for its timestamp.
+
+#include "test.h"
+
+static uint32_t seed = 12345;
+
+// 1-9 ms, so that reports land anywhere relative to step boundaries
+static uint32_t nextInterval(void) {
+  seed = seed * 1103515245 + 12345;
+  return 1 + (seed >> 16) % 9;
+}
+
+// in the joystick's numbering, bit b-1 for button b
+static uint32_t macroReport(void) {
+  pressedJoystickButtons = 0;
+  macroUpdate(millis());
+  return (uint32_t)(pressedJoystickButtons >> 1);
+}
+
+static bool keyHeld(uint8_t key) {
+  bool held = false;
+  for (const KeyEvent& e : Keyboard.events)
+    if (e.key == key)
+      held = e.press;
+  return held;
+}
+
+static void checkStepBoundaries(void) {
+  // macroAThenB: button 1 for 50 ms, nothing for 30 ms, button 2 for 50 ms
+  uint32_t start = millis();
+  macroStart(macroAThenB, start);
+  while (millis() - start < 200) {
+    uint32_t bits = macroReport();
+    uint32_t dt = millis() - start;
+    CHECK_EQUAL(dt < 50, (bits & 1) != 0);
+    CHECK_EQUAL(80 <= dt && dt < 130, (bits & 2) != 0);
+    CHECK_EQUAL(dt < 130, macroActive());
+    advanceMillis(nextInterval());
+  }
+}
+
+static MacroStep_t longMacro[201];
+
+static void checkNoDrift(void) {
+  // 100 x (button 3 for 7 ms, then nothing for 3 ms): a step boundary every 3 or 7 ms for 1 s
+  for (int i = 0; i < 200; i += 2) {
+    longMacro[i] = { JOY, 3, 7 };
+    longMacro[i + 1] = { UNDEFINED, 0, 3 };
+  }
+  longMacro[200] = { UNDEFINED, 0, 0 };
+
+  uint32_t start = millis();
+  macroStart(longMacro, start);
+  while (millis() - start < 1100) {
+    uint32_t bits = macroReport();
+    uint32_t dt = millis() - start;
+    CHECK_EQUAL(dt < 1000 && dt % 10 < 7, (bits & 4) != 0);
+    CHECK_EQUAL(dt < 1000, macroActive());
+    advanceMillis(nextInterval());
+  }
+}
+
+static MacroStep_t keyMacro[21];
+
+static void checkCatchUp(void) {
+  // keys a, b, c, ... for 10 ms each
+  for (int i = 0; i < 20; i++)
+    keyMacro[i] = { KEY, (uint8_t)('a' + i), 10 };
+  keyMacro[20] = { UNDEFINED, 0, 0 };
+
+  Keyboard.events.clear();
+  uint32_t start = millis();
+  macroStart(keyMacro, start);
+  macroUpdate(millis());
+  CHECK(keyHeld('a'));
+
+  // the loop stalls for 105 ms; the macro should be on its 11th key, 'k'
+  advanceMillis(105);
+  for (int update = 0; update < 3; update++) {
+    size_t before = Keyboard.events.size();
+    macroUpdate(millis());
+    // each step transition is a release and a press
+    CHECK(Keyboard.events.size() - before <= 2 * maxMacroStepsPerUpdate);
+  }
+  CHECK(keyHeld('k'));
+  for (int i = 0; i < 20; i++)
+    if (i != 10)
+      CHECK(!keyHeld('a' + i));
+
+  // and it stays on the original schedule
+  advanceMillis(4);
+  macroUpdate(millis());
+  CHECK(keyHeld('k'));
+  advanceMillis(1);
+  macroUpdate(millis());
+  CHECK(keyHeld('l'));
+  CHECK(!keyHeld('k'));
+
+  advanceMillis(100);
+  for (int update = 0; update < 3; update++)
+    macroUpdate(millis());
+  CHECK(!macroActive());
+  for (int i = 0; i < 20; i++)
+    CHECK(!keyHeld('a' + i));
+}
+
+static void checkMacroSlots(void) {
+  for (unsigned i = 0; i < maxActiveMacros + 2; i++)
+    macroStart(macroAThenB, millis());
+  unsigned active = 0;
+  for (unsigned i = 0; i < maxActiveMacros; i++)
+    active += activeMacros[i].step != NULL;
+  CHECK_EQUAL(maxActiveMacros, active);
+  macroStopAll();
+  CHECK(!macroActive());
+}
+
+static GameControllerData_t controller(uint16_t buttons) {
+  GameControllerData_t data = { buttons, 512, 512, 512, 512, 0, 0, CONTROLLER_GAMECUBE };
+  return data;
+}
+
+static void checkTurbo(void) {
+  // in "turbo" mode, A is a turbo button 1 with a 33 ms half period
+  const Injector_t* turbo = findInjector("turbo");
+  ExerciseMachineData_t exerciseMachine = { 0, 1, 0 };
+  GameControllerData_t released = controller(0);
+  GameControllerData_t held = controller(maskA);
+
+  inject(&Joystick, NULL, turbo, &released, &exerciseMachine);
+  advanceMillis(nextInterval());
+
+  uint32_t pressed = millis();
+  while (millis() - pressed < 1000) {
+    inject(&Joystick, NULL, turbo, &held, &exerciseMachine);
+    uint32_t dt = millis() - pressed;
+    CHECK_EQUAL(dt / 33 % 2 == 0, (Joystick.buttonBits & 1) != 0);
+    advanceMillis(nextInterval());
+  }
+
+  inject(&Joystick, NULL, turbo, &released, &exerciseMachine);
+  CHECK_EQUAL(0, Joystick.buttonBits);
+}
+
+static void checkMacroButton(void) {
+  // in "turbo" mode, X runs macroAThenB, and the macro runs on after X is let go
+  const Injector_t* turbo = findInjector("turbo");
+  ExerciseMachineData_t exerciseMachine = { 0, 1, 0 };
+  GameControllerData_t released = controller(0);
+  GameControllerData_t held = controller(maskX);
+
+  inject(&Joystick, NULL, turbo, &released, &exerciseMachine);
+  advanceMillis(nextInterval());
+
+  uint32_t pressed = millis();
+  while (millis() - pressed < 200) {
+    inject(&Joystick, NULL, turbo, millis() - pressed < 20 ? &held : &released, &exerciseMachine);
+    uint32_t dt = millis() - pressed;
+    CHECK_EQUAL(dt < 50, (Joystick.buttonBits & 1) != 0);
+    CHECK_EQUAL(80 <= dt && dt < 130, (Joystick.buttonBits & 2) != 0);
+    advanceMillis(nextInterval());
+  }
+}
+
+int main() {
+  advanceMillis(100000);
+  curJoystick = &Joystick;
+  curX360 = NULL;
+
+  checkStepBoundaries();
+  checkNoDrift();
+  checkCatchUp();
+  checkMacroSlots();
+  checkTurbo();
+  checkMacroButton();
+
+  return testResult("macro");
+}
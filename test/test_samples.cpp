@@ -0,0 +1,226 @@
+// Stress test of the GameCube controller sample handoff between the poll timer interrupt, which
+// calls pollControllers(), and loop(), which reads with readGameCubeSample(). The interrupt is
+// played by an interval timer signal, which like the real one can land anywhere in loop(),
+// including in the middle of copying a sample, and still fires while loop() is stalled the way a
+// flash erase or a USB mode switch stalls it. This is the default build, with the nunchuck
+// enabled too; it has to be read from loop() and never from the interrupt.
+//
+// Every sample encodes one counter in all of its fields, so a torn read shows up as fields that
+// disagree.
+
+#include "test.h"
+
+#ifndef POLL_IN_INTERRUPT
+#error the default configuration polls from the timer interrupt
+#endif
+#ifndef ENABLE_NUNCHUCK
+#error the default configuration has the nunchuck
+#endif
+
+#include <signal.h>
+#include <sys/time.h>
+
+#include <chrono>
+
+static volatile uint32_t produced = 0;
+static volatile unsigned nunchuckReadsInInterrupt = 0;
+
+// none of these land in the stick deadzone around 512, which would change them
+static void encode(uint32_t n, GameControllerData_t* data) {
+  data->buttons = n & 0xFFFF;
+  data->shoulderLeft = (n >> 16) & 0xFF;
+  data->shoulderRight = (n >> 24) & 0xFF;
+  data->joystickX = n % 500;
+  data->joystickY = 1023 - n % 500;
+  data->cX = n * 7 % 500;
+  data->cY = 1023 - n * 13 % 500;
+}
+
+static bool decode(const GameControllerData_t* data, uint32_t* n) {
+  *n = data->buttons | (uint32_t)data->shoulderLeft << 16 | (uint32_t)data->shoulderRight << 24;
+  GameControllerData_t expected;
+  encode(*n, &expected);
+  return data->joystickX == expected.joystickX && data->joystickY == expected.joystickY &&
+    data->cX == expected.cX && data->cY == expected.cY;
+}
+
+static void pollSignal(int) {
+  uint32_t n = produced + 1;
+  encode(n, &gameCubeInput);
+  unsigned reads = nunchuckReads;
+  pollControllers();
+  nunchuckReadsInInterrupt += nunchuckReads - reads;
+  produced = n;
+}
+
+static void startPolling(uint32_t periodMicros) {
+  struct sigaction action = {};
+  action.sa_handler = pollSignal;
+  sigaction(SIGALRM, &action, NULL);
+  struct itimerval timer = { { 0, (suseconds_t)periodMicros }, { 0, (suseconds_t)periodMicros } };
+  setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+static void stopPolling(void) {
+  struct itimerval timer = {};
+  setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+// holds the CPU, as loop() does while flash is busy
+static void stall(uint32_t us) {
+  uint32_t start = micros();
+  while (micros() - start < us)
+    ;
+}
+
+static uint32_t seed = 1;
+
+static uint32_t randomBelow(uint32_t n) {
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8) % n;
+}
+
+static void checkNoTearing(void) {
+  startPolling(20);
+
+  unsigned reads = 0, fresh = 0, torn = 0;
+  uint32_t lastN = 0, lastTime = 0, lastSequence = 0;
+  auto end = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+  // the clock can be a system call, where signals would mostly land, so it is checked rarely
+  while (reads % 4096 != 0 || std::chrono::steady_clock::now() < end) {
+    ControllerSample_t sample;
+    uint32_t sequence = readGameCubeSample(&sample);
+    reads++;
+    if (sequence == lastSequence)
+      continue;
+    lastSequence = sequence;
+    fresh++;
+    uint32_t n;
+    if (!sample.valid || !decode(&sample.data, &n)) {
+      torn++;
+      continue;
+    }
+    // never older than what we already had
+    CHECK(n > lastN);
+    CHECK((int32_t)(sample.time - lastTime) >= 0);
+    lastN = n;
+    lastTime = sample.time;
+  }
+
+  stopPolling();
+  printf("samples: %u reads, %u new samples out of %u polls, %u torn\n", reads, fresh, produced, torn);
+  CHECK_EQUAL(0, torn);
+  CHECK(fresh > 1000);
+}
+
+// Polls at the real 5 ms period while loop() stalls for up to 40 ms at a time. The poll spacing,
+// as measured by pollControllers() itself, and the age of what loop() gets after a stall should
+// both stay around the poll period, however long the stalls are.
+static void checkStalls(void) {
+  const uint32_t maxStallMicros = 40000;
+  // a USB reset restarts the poll spacing measurement, as after a reconnect
+  validUSB = 0;
+  pollControllers();
+  validUSB = 1;
+  maxPollJitterMicros = 0;
+  startPolling(pollPeriodMicros);
+
+  uint32_t maxAge = 0, maxStall = 0, lastN = 0;
+  auto end = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (std::chrono::steady_clock::now() < end) {
+    uint32_t stallMicros = randomBelow(4) == 0 ? randomBelow(maxStallMicros) : 0;
+    if (stallMicros > maxStall)
+      maxStall = stallMicros;
+    stall(stallMicros);
+
+    ControllerSample_t sample;
+    readGameCubeSample(&sample);
+    uint32_t age = micros() - sample.time;
+    if (age > maxAge)
+      maxAge = age;
+    uint32_t n;
+    CHECK(decode(&sample.data, &n));
+    CHECK(n >= lastN);
+    lastN = n;
+    stall(1000);
+  }
+
+  stopPolling();
+  printf("samples: with loop() stalls of up to %u us: poll jitter %u us, sample age up to %u us\n",
+    maxStall, maxPollJitterMicros, maxAge);
+  // The host's interval timer alone is late by several ms now and then, so the margin is wide,
+  // but a poll that waited for loop() would be off by most of a stall.
+  CHECK(maxStall > maxStallMicros / 2);
+  CHECK(maxAge < pollPeriodMicros + 10000);
+  CHECK(maxPollJitterMicros < 10000);
+}
+
+// What loop() makes of a new GameCube sample together with the nunchuck, which it reads itself:
+// with the timer still polling the GameCube controller, loop() runs the dual and single modes with
+// either controller or both connected.
+static void checkNunchuck(void) {
+  struct Case {
+    bool gameCube, nunchuck, dual;
+    uint8_t first, second;
+  };
+  static const Case cases[] = {
+    { true, true, false, CONTROLLER_GAMECUBE, CONTROLLER_NONE },
+    { true, true, true, CONTROLLER_GAMECUBE, CONTROLLER_NUNCHUCK },
+    { false, true, false, CONTROLLER_NUNCHUCK, CONTROLLER_NONE },
+    { false, true, true, CONTROLLER_NUNCHUCK, CONTROLLER_NONE },
+    { true, false, true, CONTROLLER_GAMECUBE, CONTROLLER_NONE },
+    { false, false, false, CONTROLLER_NONE, CONTROLLER_NONE },
+  };
+  nunchuckInput = { maskA, 700, 300, 512, 512, 0, 0, CONTROLLER_NUNCHUCK };
+  startPolling(pollPeriodMicros);
+
+  for (const Case& c : cases) {
+    gameCubeConnected = c.gameCube;
+    nunchuckConnected = c.nunchuck;
+    unsigned reads = nunchuckReads;
+    uint32_t lastSequence = 0;
+    // let the interrupt get in a couple of polls with the new connections
+    for (unsigned polls = 0; polls < 3; ) {
+      ControllerSample_t gameCube, sample[2];
+      uint32_t sequence = readGameCubeSample(&gameCube);
+      if (sequence == lastSequence)
+        continue;
+      lastSequence = sequence;
+      polls++;
+      assembleSamples(sample, &gameCube, c.dual);
+      if (polls < 3)
+        continue;
+      CHECK_EQUAL(c.first, validDevices[0]);
+      CHECK_EQUAL(c.second, validDevices[1]);
+      CHECK(sample[0].valid);
+      CHECK_EQUAL(c.dual, sample[1].valid);
+      if (c.first == CONTROLLER_NUNCHUCK || c.second == CONTROLLER_NUNCHUCK) {
+        const ControllerSample_t& n = sample[c.first == CONTROLLER_NUNCHUCK ? 0 : 1];
+        CHECK_EQUAL(maskA, n.data.buttons);
+        CHECK_EQUAL(700, n.data.joystickX);
+      }
+    }
+    // the nunchuck is only asked for when loop() wants it
+    CHECK_EQUAL(c.gameCube && !c.dual, nunchuckReads == reads);
+  }
+
+  stopPolling();
+  gameCubeConnected = true;
+  nunchuckConnected = false;
+}
+
+int main() {
+  realClock = true;
+  validUSB = 1;
+  gameCubeConnected = true;
+  // the interrupt must not touch the nunchuck even when there is one
+  nunchuckConnected = true;
+
+  checkNoTearing();
+  checkStalls();
+  checkNunchuck();
+  printf("samples: %u nunchuck reads from the poll interrupt\n", nunchuckReadsInInterrupt);
+  CHECK_EQUAL(0, nunchuckReadsInInterrupt);
+
+  return testResult("samples");
+}